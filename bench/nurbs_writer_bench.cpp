@@ -0,0 +1,171 @@
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <vector>
+#include <cassert>
+
+#include "common.hpp"
+
+// Microbenchmark of the .nurbs surface serializer against the previous
+// per-value stream path (one std::ofstream::write per int/float).
+// Half of the surfaces are periodic; the reference path makes them
+// non-periodic on a copy, the serializer must produce the same bytes
+// without touching the surfaces.
+// Usage: nurbs_writer_bench [faces] [poles per direction] [output dir]
+
+template<typename T>
+void binout(std::ostream &fout, const T& value) {
+  fout.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// Reference implementation, as output_nurbs wrote surfaces before
+void binout_nurbs(Handle(Geom_BSplineSurface) bspline, std::ostream &fout) {
+  if (bspline->IsUPeriodic() || bspline->IsVPeriodic()) {
+    bspline = Handle(Geom_BSplineSurface)::DownCast(bspline->Copy());
+    if (bspline->IsUPeriodic()) {
+      bspline->SetUNotPeriodic();
+    }
+    if (bspline->IsVPeriodic()) {
+      bspline->SetVNotPeriodic();
+    }
+  }
+  int n = bspline->NbUPoles()-1, m = bspline->NbVPoles()-1;
+  binout(fout, n);
+  binout(fout, m);
+
+  for (auto &point: bspline->Poles()) {
+    float point_values[4] = { 
+      static_cast<float>(point.X()), 
+      static_cast<float>(point.Y()), 
+      static_cast<float>(point.Z()), 
+      1.0f 
+    };
+    binout(fout, point_values);
+  }
+  
+  if (bspline->Weights() != nullptr) {
+    for (float weight: *bspline->Weights()) {
+      binout(fout, weight);
+    }
+  } else {
+    for (int i = 0; i < (n+1)*(m+1); ++i) {
+      float weight = 1.0f;
+      binout(fout, weight);
+    }
+  }
+
+  int u_deg = bspline->UDegree(), v_deg = bspline->VDegree();
+  binout(fout, u_deg);
+  binout(fout, v_deg);
+  for (float knot: bspline->UKnotSequence()) {
+    binout(fout, knot);
+  }
+  for (float knot: bspline->VKnotSequence()) {
+    binout(fout, knot);
+  }
+}
+
+TColStd_Array1OfReal make_knots(int nb_poles, int degree, bool periodic, TColStd_Array1OfInteger &mults) {
+  // A periodic direction has simple knots and nb_poles spans
+  int nb_knots = periodic ? nb_poles + 1 : nb_poles - degree + 1;
+  TColStd_Array1OfReal knots(1, nb_knots);
+  mults.Resize(1, nb_knots, false);
+  for (int k = 1; k <= nb_knots; ++k) {
+    knots(k) = k / 3.0;
+    mults(k) = (!periodic && (k == 1 || k == nb_knots)) ? degree+1 : 1;
+  }
+  return knots;
+}
+
+Handle(Geom_BSplineSurface) make_surface(
+    int id, int nb_poles, bool rational, bool u_periodic, bool v_periodic) {
+  const int degree = 3;
+  TColgp_Array2OfPnt poles(1, nb_poles, 1, nb_poles);
+  TColStd_Array2OfReal weights(1, nb_poles, 1, nb_poles);
+  for (int i = 1; i <= nb_poles; ++i) {
+    for (int j = 1; j <= nb_poles; ++j) {
+      poles(i, j) = gp_Pnt(i*0.37 + id, j*1.13, std::sin(0.1*id + i*j));
+      weights(i, j) = 1.0 + 0.01*((i+j+id) % 7);
+    }
+  }
+  TColStd_Array1OfInteger u_mults, v_mults;
+  auto u_knots = make_knots(nb_poles, degree, u_periodic, u_mults);
+  auto v_knots = make_knots(nb_poles, degree, v_periodic, v_mults);
+  if (rational) {
+    return new Geom_BSplineSurface(
+      poles, weights, u_knots, v_knots, u_mults, v_mults, degree, degree, u_periodic, v_periodic);
+  }
+  return new Geom_BSplineSurface(
+    poles, u_knots, v_knots, u_mults, v_mults, degree, degree, u_periodic, v_periodic);
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, const char **argv) {
+  int faces = argc > 1 ? std::stoi(argv[1]) : 100000;
+  int nb_poles = argc > 2 ? std::stoi(argv[2]) : 8;
+  std::filesystem::path dir = argc > 3 ? argv[3] : std::filesystem::temp_directory_path();
+  const int faces_per_solid = 50;
+
+  std::cout << "Generating " << faces << " surfaces with " 
+            << nb_poles << "x" << nb_poles << " poles..." << std::flush;
+  std::vector<Handle(Geom_BSplineSurface)> surfaces;
+  for (int i = 0; i < faces; ++i) {
+    // Rational and not; plain, periodic in U, periodic in U and V
+    surfaces.push_back(make_surface(i, nb_poles, i % 2 == 0, i % 4 >= 2, i % 4 == 3));
+  }
+  std::cout << "Done." << std::endl;
+
+  auto binout_path = dir / "nurbs_writer_bench_binout.nurbs";
+  auto buffered_path = dir / "nurbs_writer_bench_buffered.nurbs";
+
+  auto start = std::chrono::steady_clock::now();
+  {
+    std::ofstream fout(binout_path, std::ios::binary);
+    for (int first = 0; first < faces; first += faces_per_solid) {
+      int total = std::min(faces_per_solid, faces-first);
+      binout(fout, total);
+      for (int i = first; i < first+total; ++i) {
+        binout_nurbs(surfaces[i], fout);
+      }
+    }
+  }
+  double binout_time = seconds_since(start);
+
+  start = std::chrono::steady_clock::now();
+  {
+    std::ofstream fout(buffered_path, std::ios::binary);
+    std::vector<Handle(Geom_BSplineSurface)> solid;
+    std::string bytes;
+    for (int first = 0; first < faces; first += faces_per_solid) {
+      solid.assign(surfaces.begin()+first, surfaces.begin()+std::min(first+faces_per_solid, faces));
+      bytes.clear();
+      write_nurbs_solid(solid, bytes, 200);
+      fout.write(bytes.data(), bytes.size());
+    }
+  }
+  double buffered_time = seconds_since(start);
+
+  auto size = std::filesystem::file_size(binout_path);
+  std::ifstream a(binout_path, std::ios::binary), b(buffered_path, std::ios::binary);
+  bool identical = size == std::filesystem::file_size(buffered_path)
+    && std::equal(std::istreambuf_iterator<char>(a), std::istreambuf_iterator<char>(),
+                  std::istreambuf_iterator<char>(b));
+  std::filesystem::remove(binout_path);
+  std::filesystem::remove(buffered_path);
+
+  double mb = size / double(1 << 20);
+  std::cout << "Output size: " << mb << " MB" << std::endl;
+  std::cout << "binout:   " << binout_time << " s, " << mb/binout_time << " MB/s, " 
+            << faces/binout_time << " faces/s" << std::endl;
+  std::cout << "buffered: " << buffered_time << " s, " << mb/buffered_time << " MB/s, " 
+            << faces/buffered_time << " faces/s" << std::endl;
+  std::cout << "Speedup: " << binout_time/buffered_time << "x" << std::endl;
+  if (!identical) {
+    std::cerr << "Outputs differ!" << std::endl;
+    return 1;
+  }
+  return 0;
+}
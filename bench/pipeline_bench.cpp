@@ -0,0 +1,487 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <chrono>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <STEPControl_Writer.hxx>
+#include <Interface_Static.hxx>
+#include <BRepPrimAPI_MakeBox.hxx>
+#include <BRepPrimAPI_MakeCylinder.hxx>
+#include <BRepPrimAPI_MakeSphere.hxx>
+#include <BRepPrimAPI_MakeCone.hxx>
+#include <BRepPrimAPI_MakeTorus.hxx>
+#include <BRepPrimAPI_MakeRevol.hxx>
+#include <BRepPrimAPI_MakePrism.hxx>
+#include <BRepBuilderAPI_MakeEdge.hxx>
+#include <BRepBuilderAPI_MakeWire.hxx>
+#include <Geom_BSplineCurve.hxx>
+#include <TopoDS_Compound.hxx>
+
+#include "common.hpp"
+
+// End-to-end benchmark of the conversion pipeline on generated models.
+// Every case is written to STEP and run through process_model() (read,
+// transfer, mesh, convert, write) in a forked process, so peak memory is
+// the one of that model alone. Models are deterministic for a given
+// --scale, the best of --repeat runs is reported.
+//
+// Usage: pipeline_bench [--scale N] [--jobs N] [--repeat N] [--cases a,b]
+//                       [--work_dir DIR] [--save FILE]
+//                       [--compare FILE] [--threshold PERCENT] [--verbose]
+//
+// --save writes the results as a baseline, --compare checks them against
+// one and exits with 1 if a throughput drops or the peak memory grows by
+// more than the threshold (10% by default), or if the baseline of a case
+// is for another scale or jobs. Cases without a baseline are reported as
+// such and not compared. Baselines are only comparable on the same machine.
+
+namespace {
+
+struct BenchOptions
+{
+  int scale = 1;
+  int jobs = 1;
+  int repeat = 3;
+  std::vector<std::string> cases;
+  std::filesystem::path work_dir = std::filesystem::temp_directory_path() / "pipeline_bench";
+  std::filesystem::path save, compare;
+  double threshold = 10;
+  bool verbose = false;
+};
+
+// Sent by the child of a run through a pipe
+struct RunResult
+{
+  uint64_t solids = 0, faces = 0;
+  uint64_t input_bytes = 0, output_bytes = 0;
+  uint64_t peak_rss = 0;
+  double wall = 0;
+  double read = 0, transfer = 0, process = 0, write = 0;
+  double mesh = 0, convert = 0;     // summed over solids (and threads)
+};
+
+struct BaselineRow
+{
+  int scale = 0, jobs = 0;
+  double solids_per_s = 0, faces_per_s = 0, mb_per_s = 0, peak_mb = 0;
+};
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Closed planar profile in the XZ plane: a B-spline arc from (r, 0, 0)
+// to (r, 0, h) closed by a line, offset from the Z axis
+TopoDS_Face profile(int id, double r, double h) {
+  const int nb_poles = 6;
+  TColgp_Array1OfPnt poles(1, nb_poles);
+  for (int i = 1; i <= nb_poles; ++i) {
+    double t = (i-1) / double(nb_poles-1);
+    double bulge = (i == 1 || i == nb_poles) ? 0 : 0.3*r*(1 + 0.5*std::sin(id + 2.0*i));
+    poles(i) = gp_Pnt(r + bulge, 0, h*t);
+  }
+  TColStd_Array1OfReal knots(1, 3);
+  TColStd_Array1OfInteger mults(1, 3);
+  knots(1) = 0; knots(2) = 0.5; knots(3) = 1;
+  mults(1) = 4; mults(2) = 2; mults(3) = 4;
+  Handle(Geom_BSplineCurve) curve = new Geom_BSplineCurve(poles, knots, mults, 3);
+  BRepBuilderAPI_MakeWire wire(
+    BRepBuilderAPI_MakeEdge(curve).Edge(),
+    BRepBuilderAPI_MakeEdge(poles(nb_poles), poles(1)).Edge());
+  return BRepBuilderAPI_MakeFace(wire.Wire(), true).Face();
+}
+
+// Grid of analytic primitives: planes, cylinders, cones, spheres, tori
+TopoDS_Shape primitives(int scale) {
+  TopoDS_Compound compound;
+  BRep_Builder builder;
+  builder.MakeCompound(compound);
+  int count = 200*scale;
+  int side = static_cast<int>(std::ceil(std::sqrt(count)));
+  for (int i = 0; i < count; ++i) {
+    gp_Ax2 axis(gp_Pnt(10.0*(i % side), 10.0*(i / side), 0), gp::DZ());
+    double size = 2 + (i % 7)*0.5;
+    switch (i % 5) {
+      case 0: builder.Add(compound, BRepPrimAPI_MakeBox(axis, size, size*1.5, size*0.7).Shape()); break;
+      case 1: builder.Add(compound, BRepPrimAPI_MakeCylinder(axis, size*0.5, size*2).Shape()); break;
+      case 2: builder.Add(compound, BRepPrimAPI_MakeCone(axis, size*0.6, size*0.2, size*2).Shape()); break;
+      case 3: builder.Add(compound, BRepPrimAPI_MakeSphere(axis, size*0.7).Shape()); break;
+      case 4: builder.Add(compound, BRepPrimAPI_MakeTorus(axis, size, size*0.3).Shape()); break;
+    }
+  }
+  return compound;
+}
+
+// Solids of revolution of B-spline profiles (GeomAbs_SurfaceOfRevolution)
+TopoDS_Shape revolved(int scale) {
+  TopoDS_Compound compound;
+  BRep_Builder builder;
+  builder.MakeCompound(compound);
+  for (int i = 0; i < 50*scale; ++i) {
+    gp_Trsf placement;
+    placement.SetTranslation(gp_Vec(20.0*(i % 10), 20.0*(i / 10), 0));
+    auto solid = BRepPrimAPI_MakeRevol(profile(i, 2, 5), gp::OZ()).Shape();
+    builder.Add(compound, solid.Moved(TopLoc_Location(placement)));
+  }
+  return compound;
+}
+
+// Extrusions of B-spline profiles (GeomAbs_SurfaceOfExtrusion)
+TopoDS_Shape extruded(int scale) {
+  TopoDS_Compound compound;
+  BRep_Builder builder;
+  builder.MakeCompound(compound);
+  for (int i = 0; i < 100*scale; ++i) {
+    gp_Trsf placement;
+    placement.SetTranslation(gp_Vec(10.0*(i % 20), 10.0*(i / 20), 0));
+    auto solid = BRepPrimAPI_MakePrism(profile(i, 1, 3), gp_Vec(0, 4 + i % 5, 0)).Shape();
+    builder.Add(compound, solid.Moved(TopLoc_Location(placement)));
+  }
+  return compound;
+}
+
+// Large assembly of a few parts instanced many times
+TopoDS_Shape assembly(int scale) {
+  std::vector<TopoDS_Shape> parts = {
+    BRepPrimAPI_MakeRevol(profile(0, 1, 4), gp::OZ()).Shape(),
+    BRepPrimAPI_MakeCylinder(0.5, 6).Shape(),
+    BRepPrimAPI_MakeBox(3, 3, 0.5).Shape(),
+  };
+  TopoDS_Compound compound;
+  BRep_Builder builder;
+  builder.MakeCompound(compound);
+  for (int i = 0; i < 2000*scale; ++i) {
+    gp_Trsf rotation, translation;
+    rotation.SetRotation(gp::OZ(), 0.1*i);
+    translation.SetTranslation(gp_Vec(5.0*(i % 50), 5.0*(i / 50), 0));
+    builder.Add(compound, parts[i % parts.size()].Moved(TopLoc_Location(translation * rotation)));
+  }
+  return compound;
+}
+
+const std::map<std::string, TopoDS_Shape(*)(int)> generators = {
+  {"primitives", primitives},
+  {"revolved", revolved},
+  {"extruded", extruded},
+  {"assembly", assembly},
+};
+
+void write_all(int fd, const void *data, size_t size) {
+  auto ptr = static_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t written = ::write(fd, ptr, size);
+    if (written <= 0) {
+      _exit(2);
+    }
+    ptr += written;
+    size -= written;
+  }
+}
+
+// Runs work() in a child process, returns the bytes it sent through fd
+template<typename Work>
+std::string run_forked(bool verbose, const Work &work) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    throw std::runtime_error(std::string("pipe() failed: ") + std::strerror(errno));
+  }
+  std::cout << std::flush;
+  pid_t pid = fork();
+  if (pid < 0) {
+    throw std::runtime_error(std::string("fork() failed: ") + std::strerror(errno));
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    if (!verbose) {
+      int null = open("/dev/null", O_WRONLY);
+      dup2(null, STDOUT_FILENO);
+    }
+    try {
+      OCC_CATCH_SIGNALS
+      work(fds[1]);
+    } catch(Standard_Failure &err) {
+      std::cerr << err.GetMessageString() << std::endl;
+      _exit(1);
+    } catch(std::exception &err) {
+      std::cerr << err.what() << std::endl;
+      _exit(1);
+    }
+    std::cout << std::flush;
+    _exit(0);
+  }
+  close(fds[1]);
+  std::string data;
+  char buf[4096];
+  ssize_t size;
+  while ((size = read(fds[0], buf, sizeof(buf))) > 0) {
+    data.append(buf, size);
+  }
+  close(fds[0]);
+  int status = 0;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    throw std::runtime_error("benchmark process failed");
+  }
+  return data;
+}
+
+void generate(const std::string &name, int scale, const std::filesystem::path &path) {
+  auto shape = generators.at(name)(scale);
+  // Shared parts are written as STEP assemblies, so they are read back as
+  // instances of the same TShape
+  Interface_Static::SetIVal("write.step.assembly", 1);
+  STEPControl_Writer writer;
+  if (writer.Transfer(shape, STEPControl_AsIs) != IFSelect_RetDone
+      || writer.Write(path.c_str()) != IFSelect_RetDone) {
+    throw std::runtime_error("can't write " + path.string());
+  }
+}
+
+RunResult run(const std::filesystem::path &path, const BenchOptions &bench) {
+  PipelineOptions options;
+  options.save_dir = bench.work_dir / "out";
+  options.jobs = bench.jobs;
+  options.nurbs_version = 300;
+  options.mesh_container = true;
+  options.metrics = true;
+  std::filesystem::remove_all(options.save_dir);
+
+  RunMetrics metrics;
+  auto start = std::chrono::steady_clock::now();
+  RunResult result;
+  result.solids = process_model(path, options, &metrics);
+  result.wall = seconds_since(start);
+  result.peak_rss = peak_resident_memory();
+
+  for (auto &stage: metrics.stages) {
+    if (stage.name == "read") {
+      result.read = stage.time.wall;
+      result.input_bytes = stage.bytes;
+    } else if (stage.name == "transfer") {
+      result.transfer = stage.time.wall;
+    } else if (stage.name == "process") {
+      result.process = stage.time.wall;
+    } else if (stage.name == "write") {
+      result.write = stage.time.wall;
+      result.output_bytes = stage.bytes;
+    }
+  }
+  for (auto &solid: metrics.solids) {
+    for (auto count: solid.face_types) {
+      result.faces += count;
+    }
+    result.mesh += solid.mesh.wall;
+    result.convert += solid.convert.wall;
+  }
+  return result;
+}
+
+double per_second(double value, double wall) {
+  return wall > 0 ? value / wall : 0;
+}
+
+BaselineRow summary(const RunResult &result, const BenchOptions &bench) {
+  BaselineRow row;
+  row.scale = bench.scale;
+  row.jobs = bench.jobs;
+  row.solids_per_s = per_second(result.solids, result.wall);
+  row.faces_per_s = per_second(result.faces, result.wall);
+  row.mb_per_s = per_second(result.input_bytes / double(1 << 20), result.wall);
+  row.peak_mb = result.peak_rss / double(1 << 20);
+  return row;
+}
+
+// Tab separated: case, scale, jobs, solids/s, faces/s, MB/s, peak MB;
+// lines starting with '#' are comments
+std::map<std::string, BaselineRow> read_baselines(const std::filesystem::path &path) {
+  std::ifstream in(path);
+  if (!in) {
+    throw std::runtime_error("can't open " + path.string());
+  }
+  std::map<std::string, BaselineRow> rows;
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream fields(line);
+    std::string name;
+    BaselineRow row;
+    if (fields >> name >> row.scale >> row.jobs
+               >> row.solids_per_s >> row.faces_per_s >> row.mb_per_s >> row.peak_mb) {
+      rows[name] = row;
+    }
+  }
+  return rows;
+}
+
+void write_baselines(const std::filesystem::path &path, const std::map<std::string, BaselineRow> &rows) {
+  std::ofstream out(path);
+  if (!out) {
+    throw std::runtime_error("can't open " + path.string() + " for writing");
+  }
+  out << "# case\tscale\tjobs\tsolids/s\tfaces/s\tMB/s\tpeak MB\n";
+  for (auto &[name, row]: rows) {
+    out << name << '\t' << row.scale << '\t' << row.jobs << '\t'
+        << row.solids_per_s << '\t' << row.faces_per_s << '\t'
+        << row.mb_per_s << '\t' << row.peak_mb << '\n';
+  }
+}
+
+// Prints the changes against the baseline, returns false on a regression
+// or a baseline that can't be compared
+bool compare(const std::string &name, const BaselineRow &row, const BaselineRow &baseline, double threshold) {
+  if (row.scale != baseline.scale || row.jobs != baseline.jobs) {
+    std::cout << name << ": baseline is for scale " << baseline.scale
+              << ", jobs " << baseline.jobs << ", not comparable" << std::endl;
+    return false;
+  }
+  bool ok = true;
+  auto check = [&](const char *metric, double value, double base, bool higher_is_better) {
+    double change = base > 0 ? (value - base) / base * 100 : 0;
+    bool regression = higher_is_better ? change < -threshold : change > threshold;
+    ok = ok && !regression;
+    std::cout << "  " << std::left << std::setw(10) << metric << std::right
+              << std::setw(12) << base << " -> " << std::setw(12) << value
+              << " (" << std::showpos << change << std::noshowpos << "%)"
+              << (regression ? "  REGRESSION" : "") << std::endl;
+  };
+  std::cout << name << ":" << std::endl;
+  check("solids/s", row.solids_per_s, baseline.solids_per_s, true);
+  check("faces/s", row.faces_per_s, baseline.faces_per_s, true);
+  check("MB/s", row.mb_per_s, baseline.mb_per_s, true);
+  check("peak MB", row.peak_mb, baseline.peak_mb, false);
+  return ok;
+}
+
+BenchOptions parse_args(int argc, const char **argv) {
+  BenchOptions bench;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--verbose") {
+      bench.verbose = true;
+      continue;
+    }
+    if (i+1 >= argc) {
+      throw std::invalid_argument("missing value of " + arg);
+    }
+    std::string value = argv[++i];
+    if (arg == "--scale") {
+      bench.scale = std::max(std::stoi(value), 1);
+    } else if (arg == "--jobs") {
+      bench.jobs = std::max(std::stoi(value), 1);
+    } else if (arg == "--repeat") {
+      bench.repeat = std::max(std::stoi(value), 1);
+    } else if (arg == "--cases") {
+      std::istringstream names(value);
+      std::string name;
+      while (std::getline(names, name, ',')) {
+        if (!generators.count(name)) {
+          throw std::invalid_argument("unknown case " + name);
+        }
+        bench.cases.push_back(name);
+      }
+    } else if (arg == "--work_dir") {
+      bench.work_dir = value;
+    } else if (arg == "--save") {
+      bench.save = value;
+    } else if (arg == "--compare") {
+      bench.compare = value;
+    } else if (arg == "--threshold") {
+      bench.threshold = std::stod(value);
+    } else {
+      throw std::invalid_argument("unknown argument " + arg);
+    }
+  }
+  if (bench.cases.empty()) {
+    for (auto &[name, generator]: generators) {
+      bench.cases.push_back(name);
+    }
+  }
+  return bench;
+}
+
+} // namespace
+
+int main(int argc, const char **argv) {
+  OSD::SetSignal(false);
+  auto bench = parse_args(argc, argv);
+  std::filesystem::create_directories(bench.work_dir);
+
+  std::map<std::string, BaselineRow> results;
+  std::cout << std::fixed << std::setprecision(2);
+  std::cout << "case        solids   faces     MB   wall s  solids/s   faces/s    MB/s  peak MB"
+            << "   read  transfer  process  write   mesh  convert" << std::endl;
+  for (auto &name: bench.cases) {
+    auto path = bench.work_dir / (name + ".step");
+    run_forked(bench.verbose, [&](int) { generate(name, bench.scale, path); });
+
+    RunResult best;
+    for (int i = 0; i < bench.repeat; ++i) {
+      auto data = run_forked(bench.verbose, [&](int fd) {
+        auto result = run(path, bench);
+        write_all(fd, &result, sizeof(result));
+      });
+      if (data.size() != sizeof(RunResult)) {
+        throw std::runtime_error("truncated result of " + name);
+      }
+      RunResult result;
+      std::memcpy(&result, data.data(), sizeof(result));
+      if (i == 0 || result.wall < best.wall) {
+        best = result;
+      }
+    }
+
+    auto row = summary(best, bench);
+    results[name] = row;
+    std::cout << std::left << std::setw(10) << name << std::right
+              << std::setw(8) << best.solids << std::setw(8) << best.faces
+              << std::setw(7) << best.input_bytes / double(1 << 20)
+              << std::setw(9) << best.wall
+              << std::setw(10) << row.solids_per_s << std::setw(10) << row.faces_per_s
+              << std::setw(8) << row.mb_per_s << std::setw(9) << row.peak_mb
+              << std::setw(7) << best.read << std::setw(10) << best.transfer
+              << std::setw(9) << best.process << std::setw(7) << best.write
+              << std::setw(7) << best.mesh << std::setw(9) << best.convert << std::endl;
+  }
+  std::filesystem::remove_all(bench.work_dir / "out");
+
+  if (!bench.save.empty()) {
+    auto rows = std::filesystem::exists(bench.save) ? read_baselines(bench.save) : std::map<std::string, BaselineRow>{};
+    for (auto &[name, row]: results) {
+      rows[name] = row;
+    }
+    write_baselines(bench.save, rows);
+    std::cout << "Baselines saved to " << bench.save << std::endl;
+  }
+
+  bool ok = true;
+  size_t missing = 0;
+  if (!bench.compare.empty()) {
+    auto baselines = read_baselines(bench.compare);
+    std::cout << std::setprecision(2) << "Threshold " << bench.threshold << "%" << std::endl;
+    for (auto &[name, row]: results) {
+      auto it = baselines.find(name);
+      if (it == baselines.end()) {
+        std::cout << name << ": no baseline, save one with --save on the reference machine" << std::endl;
+        ++missing;
+        continue;
+      }
+      ok = compare(name, row, it->second, bench.threshold) && ok;
+    }
+    std::cout << (ok ? "No regressions" : "Regressions or incomparable baselines found");
+    if (missing) {
+      std::cout << ", " << missing << " case(s) without a baseline";
+    }
+    std::cout << "." << std::endl;
+  }
+  return ok ? 0 : 1;
+}
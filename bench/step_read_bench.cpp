@@ -0,0 +1,228 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <chrono>
+#include <vector>
+#include <cmath>
+
+#include <STEPControl_Writer.hxx>
+#include <StepData_StepModel.hxx>
+#include <StepData_StepWriter.hxx>
+#include <StepData_Protocol.hxx>
+#include <XSControl_WorkSession.hxx>
+#include <BRepBuilderAPI_NurbsConvert.hxx>
+#include <BRepPrimAPI_MakeBox.hxx>
+#include <BRepPrimAPI_MakeCylinder.hxx>
+#include <BRepPrimAPI_MakeSphere.hxx>
+#include <BRepPrimAPI_MakeTorus.hxx>
+#include <Interface_InterfaceModel.hxx>
+#include <Message.hxx>
+#include <Message_Messenger.hxx>
+#include <Message_PrinterOStream.hxx>
+
+#include "common.hpp"
+
+// Compares the stock STEPControl_Reader::ReadFile with read_step_parallel()
+// on the same files: best wall time of --repeat reads with each, and the
+// models they produce, which must have the same entities, type by type,
+// the same transfer roots, and write back the same STEP text entity by
+// entity, so a parameter or sub-list linked to the wrong record shows up.
+// Files the parallel reader does not support are reported with the reason.
+//
+// Usage: step_read_bench [--jobs N] [--repeat N] [--scale N]
+//                        [--work_dir DIR] [file.step...]
+//
+// Without files, a generated model of 1000*scale primitives is written to
+// --work_dir and read. A fifth of them are converted to NURBS, giving
+// rational B-spline surfaces written as complex entities; the model
+// spans several chunks from the first scale on, each numbering its
+// sub-lists from 1. Exits with 1 if the models of a file differ.
+
+namespace {
+
+struct BenchOptions
+{
+  int jobs = std::max(1u, std::thread::hardware_concurrency());
+  int repeat = 3;
+  int scale = 1;
+  std::filesystem::path work_dir = std::filesystem::temp_directory_path() / "step_read_bench";
+  std::vector<std::filesystem::path> files;
+};
+
+// Types of the entities of the model, in order, its roots and the lines
+// of the model written back to STEP
+struct ModelSummary
+{
+  std::vector<std::string> types;
+  int roots = 0;
+  std::vector<std::string> text;
+};
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::filesystem::path generate(const BenchOptions &bench) {
+  TopoDS_Compound compound;
+  BRep_Builder builder;
+  builder.MakeCompound(compound);
+  int count = 1000*bench.scale;
+  int side = static_cast<int>(std::ceil(std::sqrt(count)));
+  for (int i = 0; i < count; ++i) {
+    gp_Ax2 axis(gp_Pnt(10.0*(i % side), 10.0*(i / side), 0), gp::DZ());
+    double size = 2 + (i % 7)*0.5;
+    switch (i % 5) {
+      case 0: builder.Add(compound, BRepPrimAPI_MakeBox(axis, size, size*1.5, size*0.7).Shape()); break;
+      case 1: builder.Add(compound, BRepPrimAPI_MakeCylinder(axis, size*0.5, size*2).Shape()); break;
+      case 2: builder.Add(compound, BRepPrimAPI_MakeSphere(axis, size*0.7).Shape()); break;
+      case 3: builder.Add(compound, BRepPrimAPI_MakeTorus(axis, size, size*0.3).Shape()); break;
+      case 4: builder.Add(compound, BRepBuilderAPI_NurbsConvert(BRepPrimAPI_MakeTorus(axis, size, size*0.3).Shape()).Shape()); break;
+    }
+  }
+  std::filesystem::create_directories(bench.work_dir);
+  auto path = bench.work_dir / ("generated_" + std::to_string(bench.scale) + ".step");
+  STEPControl_Writer writer;
+  if (writer.Transfer(compound, STEPControl_AsIs) != IFSelect_RetDone
+      || writer.Write(path.c_str()) != IFSelect_RetDone) {
+    throw std::runtime_error("can't write " + path.string());
+  }
+  return path;
+}
+
+ModelSummary summary(STEPControl_Reader &reader) {
+  ModelSummary result;
+  auto model = reader.Model();
+  for (int i = 1; i <= model->NbEntities(); ++i) {
+    result.types.push_back(model->Value(i)->DynamicType()->Name());
+  }
+  result.roots = reader.NbRootsForTransfer();
+  auto protocol = Handle(StepData_Protocol)::DownCast(reader.WS()->Protocol());
+  StepData_StepWriter writer(reader.StepModel());
+  writer.SendModel(protocol);
+  std::ostringstream out;
+  writer.Print(out);
+  std::istringstream lines(out.str());
+  for (std::string line; std::getline(lines, line);) {
+    result.text.push_back(line);
+  }
+  return result;
+}
+
+// Best time of bench.repeat reads, the summary of the last model. Empty
+// reason on success, why the parallel reader fell back otherwise
+double time_reads(
+    const std::filesystem::path &path, const BenchOptions &bench, bool parallel,
+    ModelSummary &model, std::string &reason) {
+  double best = 0;
+  for (int run = 0; run < bench.repeat; ++run) {
+    STEPControl_Reader reader;
+    auto start = std::chrono::steady_clock::now();
+    if (parallel) {
+      if (!read_step_parallel(reader, path, bench.jobs, reason)) {
+        return 0;
+      }
+    } else if (reader.ReadFile(path.c_str()) != IFSelect_RetDone) {
+      throw std::runtime_error("can't read " + path.string());
+    }
+    double wall = seconds_since(start);
+    best = run == 0 ? wall : std::min(best, wall);
+    if (run + 1 == bench.repeat) {
+      model = summary(reader);
+    }
+  }
+  return best;
+}
+
+// Describes the first difference, empty if none
+std::string difference(const ModelSummary &stock, const ModelSummary &parallel) {
+  if (stock.types.size() != parallel.types.size()) {
+    return std::to_string(stock.types.size()) + " entities, " + std::to_string(parallel.types.size()) + " in parallel";
+  }
+  for (size_t i = 0; i < stock.types.size(); ++i) {
+    if (stock.types[i] != parallel.types[i]) {
+      return "entity " + std::to_string(i+1) + ": " + stock.types[i] + ", " + parallel.types[i] + " in parallel";
+    }
+  }
+  if (stock.roots != parallel.roots) {
+    return std::to_string(stock.roots) + " roots, " + std::to_string(parallel.roots) + " in parallel";
+  }
+  for (size_t i = 0; i < std::max(stock.text.size(), parallel.text.size()); ++i) {
+    std::string line = i < stock.text.size() ? stock.text[i] : "<end>";
+    std::string other = i < parallel.text.size() ? parallel.text[i] : "<end>";
+    if (line != other) {
+      return "written line " + std::to_string(i+1) + ": " + line + ", " + other + " in parallel";
+    }
+  }
+  return std::string();
+}
+
+BenchOptions parse_args(int argc, const char **argv) {
+  BenchOptions bench;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg.rfind("--", 0) != 0) {
+      bench.files.push_back(arg);
+      continue;
+    }
+    if (i+1 >= argc) {
+      throw std::invalid_argument("missing value of " + arg);
+    }
+    std::string value = argv[++i];
+    if (arg == "--jobs") {
+      bench.jobs = std::max(std::stoi(value), 1);
+    } else if (arg == "--repeat") {
+      bench.repeat = std::max(std::stoi(value), 1);
+    } else if (arg == "--scale") {
+      bench.scale = std::max(std::stoi(value), 1);
+    } else if (arg == "--work_dir") {
+      bench.work_dir = value;
+    } else {
+      throw std::invalid_argument("unknown argument " + arg);
+    }
+  }
+  return bench;
+}
+
+} // namespace
+
+int main(int argc, const char **argv) {
+  try {
+    auto bench = parse_args(argc, argv);
+    if (bench.files.empty()) {
+      bench.files.push_back(generate(bench));
+    }
+    // The stock reader reports its checks through the messenger
+    Message::DefaultMessenger()->RemovePrinters(STANDARD_TYPE(Message_PrinterOStream));
+
+    std::cout << std::fixed << std::setprecision(3)
+              << "jobs " << bench.jobs << ", best of " << bench.repeat << std::endl
+              << "file\tMB\tstock s\tparallel s\tspeedup\tentities\tresult" << std::endl;
+    bool ok = true;
+    for (auto &path: bench.files) {
+      ModelSummary stock, parallel;
+      std::string reason;
+      double stock_wall = time_reads(path, bench, false, stock, reason);
+      double parallel_wall = time_reads(path, bench, true, parallel, reason);
+      std::cout << path.filename().string() << '\t'
+                << std::filesystem::file_size(path) / double(1 << 20) << '\t'
+                << stock_wall << '\t';
+      if (!reason.empty()) {
+        std::cout << "-\t-\t" << stock.types.size() << "\tfallback: " << reason << std::endl;
+        continue;
+      }
+      auto diff = difference(stock, parallel);
+      ok = ok && diff.empty();
+      std::cout << parallel_wall << '\t'
+                << (parallel_wall > 0 ? stock_wall / parallel_wall : 0) << "x\t"
+                << stock.types.size() << '\t'
+                << (diff.empty() ? "same model" : "DIFFERENT: " + diff) << std::endl;
+    }
+    return ok ? 0 : 1;
+  } catch(std::exception &err) {
+    std::cerr << err.what() << std::endl;
+    return 2;
+  } catch(Standard_Failure &err) {
+    std::cerr << err.GetMessageString() << std::endl;
+    return 2;
+  }
+}
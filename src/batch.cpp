@@ -0,0 +1,203 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <set>
+#include <deque>
+#include <condition_variable>
+
+#include "common.hpp"
+
+// Batch mode (--batch): models are converted by one long-lived process,
+// so the OCCT toolkits and the STEP protocol are initialized only once.
+// Up to batch.jobs models run concurrently; a new one only starts while
+// the memory budget has room for it. Every model is written into its own
+// subdirectory of save_dir, save_dir/batch_status.tsv gets a line per
+// finished model.
+
+namespace {
+
+// Rough peak memory of a model per byte of its file, used to reserve the
+// memory budget before the model's RSS actually grows
+constexpr size_t model_memory_factor = 20;
+
+bool is_model(const std::filesystem::path &path) {
+  auto extension = path.extension();
+  return extension == ".step" || extension == ".stp" || extension == ".brep" || extension == ".brepstream";
+}
+
+// Model paths of a batch: lines of a manifest (relative paths are relative
+// to the manifest, empty lines and '#' comments are skipped), models found
+// in a directory, or lines of stdin read as they arrive.
+class PathSource
+{
+public:
+  explicit PathSource(const std::string &source) {
+    if (source == "-") {
+      in = &std::cin;
+    } else if (std::filesystem::is_directory(source)) {
+      for (auto &entry: std::filesystem::recursive_directory_iterator(source)) {
+        if (entry.is_regular_file() && is_model(entry.path())) {
+          files.push_back(entry.path());
+        }
+      }
+      std::sort(files.begin(), files.end());
+    } else {
+      manifest.open(source);
+      if (!manifest) {
+        throw std::runtime_error("can't open batch manifest " + source);
+      }
+      in = &manifest;
+      base = std::filesystem::path(source).parent_path();
+    }
+  }
+
+  bool next(std::filesystem::path &path) {
+    if (!in) {
+      if (pos == files.size()) {
+        return false;
+      }
+      path = files[pos++];
+      return true;
+    }
+    std::string line;
+    while (std::getline(*in, line)) {
+      auto first = line.find_first_not_of(" \t\r");
+      auto last = line.find_last_not_of(" \t\r");
+      if (first == std::string::npos || line[first] == '#') {
+        continue;
+      }
+      path = line.substr(first, last - first + 1);
+      if (path.is_relative()) {
+        path = base / path;
+      }
+      return true;
+    }
+    return false;
+  }
+
+private:
+  std::istream *in = nullptr;
+  std::ifstream manifest;
+  std::filesystem::path base;
+  std::vector<std::filesystem::path> files;
+  size_t pos = 0;
+};
+
+struct BatchJob
+{
+  std::filesystem::path file_path;
+  std::filesystem::path save_dir;
+};
+
+} // namespace
+
+void run_batch(const BatchOptions &batch, const PipelineOptions &options) {
+  // Workers are forked by the thread of their model: the other models'
+  // threads may hold OCCT locks at that moment, and their pipes would be
+  // inherited by the child, hiding the end of a crashed worker
+  if (options.isolate && batch.jobs > 1) {
+    throw std::invalid_argument("--isolate can't be combined with --batch_jobs greater than 1");
+  }
+  std::filesystem::create_directories(options.save_dir);
+  std::ofstream status(options.save_dir / "batch_status.tsv");
+  status << "file\tstatus\tseconds\tsolids\tmessage" << std::endl;
+
+  std::mutex mutex;
+  std::condition_variable queue_cv, memory_cv;
+  std::deque<BatchJob> queue;
+  bool finished = false;
+  int running = 0, done = 0, failed = 0;
+  size_t reserved = 0;
+
+  auto worker = [&]() {
+    while (true) {
+      BatchJob job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        queue_cv.wait(lock, [&]() { return finished || !queue.empty(); });
+        if (queue.empty()) {
+          return;
+        }
+        job = std::move(queue.front());
+        queue.pop_front();
+        queue_cv.notify_all();
+      }
+
+      std::error_code ec;
+      size_t estimate = std::filesystem::file_size(job.file_path, ec) * model_memory_factor;
+      {
+        // A model always starts when nothing else runs, so one bigger than
+        // the whole budget still gets processed
+        std::unique_lock<std::mutex> lock(mutex);
+        while (batch.memory && running > 0
+               && std::max(resident_memory(), reserved) + estimate > batch.memory) {
+          memory_cv.wait_for(lock, std::chrono::milliseconds(100));
+        }
+        ++running;
+        reserved += estimate;
+      }
+
+      auto job_options = options;
+      job_options.save_dir = job.save_dir;
+      if (options.metrics) {
+        job_options.metrics_path = job.save_dir / options.metrics_path.filename();
+      }
+      auto start = std::chrono::steady_clock::now();
+      int solids = 0;
+      std::string message;
+      bool ok = false;
+      try {
+        solids = process_model(job.file_path, job_options);
+        ok = true;
+      } catch(Standard_Failure &err) {
+        message = err.GetMessageString();
+      } catch(std::exception &err) {
+        message = err.what();
+      } catch(...) {
+        message = "Unknown";
+      }
+      if (!ok) {
+        reporter().error(-1, job.file_path.string() + ": " + message);
+      }
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+      std::lock_guard<std::mutex> lock(mutex);
+      --running;
+      reserved -= estimate;
+      ++done;
+      failed += !ok;
+      status << job.file_path.string() << '\t' << (ok ? "ok" : "failed") << '\t'
+             << elapsed.count() << '\t' << solids << '\t' << message << std::endl;
+      memory_cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (int i = 0; i < batch.jobs; ++i) {
+    workers.emplace_back(worker);
+  }
+
+  // Subdirectories are named after the models, repeated names get a suffix
+  PathSource source(batch.source);
+  std::set<std::string> names;
+  std::filesystem::path path;
+  while (source.next(path)) {
+    auto name = path.stem().string();
+    for (int suffix = 1; !names.insert(name).second; ++suffix) {
+      name = path.stem().string() + "_" + std::to_string(suffix);
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    queue_cv.wait(lock, [&]() { return queue.size() < workers.size(); });
+    queue.push_back({path, options.save_dir / name});
+    queue_cv.notify_all();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    finished = true;
+    queue_cv.notify_all();
+  }
+  for (auto &th: workers) {
+    th.join();
+  }
+  reporter().message("Batch: " + std::to_string(done) + " models, " + std::to_string(failed) + " failed");
+}
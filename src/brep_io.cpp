@@ -0,0 +1,180 @@
+#include <cstring>
+
+#include "common.hpp"
+
+// BRep files in three formats:
+//   ascii   - BRepTools text format
+//   binary  - BinTools format, several times smaller and faster to parse
+//   stream  - solids appended one by one as they are produced:
+//               char magic[32]                 - stream_magic, zero padded
+//               { uint64_t size; char data[size]; }...
+//             every data is a complete BinTools file of a single solid.
+//             The file is complete after every added solid, so it is
+//             written without keeping the solids in memory. Records share
+//             nothing: instances of a part each store its whole geometry,
+//             so an assembly is as large as if it was flattened, and read
+//             back they are distinct TShapes that InstanceCache can't
+//             reuse. ascii and binary keep the sharing of the compound.
+// A stream is no BRep file for BinTools::Read or DRAW, model outputs in
+// that format are named .brepstream (single shapes, like the Fails/ dumps,
+// are plain BinTools files). Input files are recognized from their first
+// bytes, whatever their extension.
+
+namespace {
+
+const char stream_magic[32] = "OCCT-STEP-Reader BRep stream 1";
+// First bytes of every BinTools file version
+const char binary_magic[] = "Open CASCADE Topology V";
+
+BRepFormat detect_format(std::istream &in) {
+  char head[sizeof(stream_magic)] = {};
+  in.read(head, sizeof(head));
+  auto count = in.gcount();
+  in.clear();
+  in.seekg(0);
+  if (count == sizeof(stream_magic) && std::memcmp(head, stream_magic, sizeof(stream_magic)) == 0) {
+    return BRepFormat::stream;
+  }
+  if (count >= static_cast<std::streamsize>(sizeof(binary_magic) - 1)
+      && std::memcmp(head, binary_magic, sizeof(binary_magic) - 1) == 0) {
+    return BRepFormat::binary;
+  }
+  return BRepFormat::ascii;
+}
+
+// Compound of all solids of a stream file
+void read_brep_stream(std::istream &in, TopoDS_Shape &shape, const Message_ProgressRange &range) {
+  in.seekg(0, std::ios::end);
+  uint64_t file_size = in.tellg();
+  in.seekg(sizeof(stream_magic));
+
+  TopoDS_Compound compound;
+  BRep_Builder builder;
+  builder.MakeCompound(compound);
+  Message_ProgressScope progress(range, "Reading BRep stream", static_cast<double>(file_size));
+  uint64_t size;
+  while (in.read(reinterpret_cast<char*>(&size), sizeof(size))) {
+    uint64_t start = in.tellg();
+    if (size == 0 || size > file_size - start) {
+      throw std::runtime_error("truncated BRep stream record");
+    }
+    TopoDS_Shape solid;
+    BinTools::Read(solid, in);
+    builder.Add(compound, solid);
+    in.clear();
+    in.seekg(start + size);
+    progress.Next(static_cast<double>(size + sizeof(size)));
+  }
+  shape = compound;
+}
+
+} // namespace
+
+BRepFormat brep_format(const std::string &name) {
+  if (name == "ascii") {
+    return BRepFormat::ascii;
+  }
+  if (name == "binary") {
+    return BRepFormat::binary;
+  }
+  if (name == "stream") {
+    return BRepFormat::stream;
+  }
+  throw std::invalid_argument("BRep format must be ascii, binary or stream");
+}
+
+std::string brep_extension(BRepFormat format) {
+  return format == BRepFormat::stream ? ".brepstream" : ".brep";
+}
+
+void read_brep(const std::filesystem::path &path, TopoDS_Shape &shape, const Message_ProgressRange &range) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    throw std::runtime_error("can't open " + path.string());
+  }
+  switch (detect_format(in)) {
+  case BRepFormat::stream:
+    read_brep_stream(in, shape, range);
+    break;
+  case BRepFormat::binary:
+    BinTools::Read(shape, in, range);
+    break;
+  case BRepFormat::ascii: {
+    BRep_Builder builder;
+    BRepTools::Read(shape, in, builder, range);
+    break;
+  }
+  }
+  if (shape.IsNull()) {
+    throw std::runtime_error("can't read " + path.string());
+  }
+}
+
+void write_brep(const TopoDS_Shape &shape, const std::filesystem::path &path, BRepFormat format) {
+  if (format == BRepFormat::ascii) {
+    if (!BRepTools::Write(shape, path.c_str())) {
+      throw std::runtime_error("can't write " + path.string());
+    }
+    return;
+  }
+  // A single shape is the same in both binary formats
+  if (!BinTools::Write(shape, path.c_str())) {
+    throw std::runtime_error("can't write " + path.string());
+  }
+}
+
+BRepFileWriter::BRepFileWriter(const std::filesystem::path &path, BRepFormat format, TopAbs_ShapeEnum container)
+  : path(path), format(format) {
+  if (format == BRepFormat::stream) {
+    fout.open(path, std::ios::binary);
+    if (!fout) {
+      throw std::runtime_error("can't open " + path.string() + " for writing");
+    }
+    fout.write(stream_magic, sizeof(stream_magic));
+  } else if (container == TopAbs_COMPOUND) {
+    BRep_Builder builder;
+    builder.MakeCompound(TopoDS::Compound(solids));
+  } else {
+    BRep_Builder builder;
+    builder.MakeCompSolid(TopoDS::CompSolid(solids));
+  }
+}
+
+BRepFileWriter::~BRepFileWriter() {
+  // Left by an exception: the output is incomplete anyway, so the
+  // collected solids are not written. A stream keeps its complete records
+  if (!closed && fout.is_open()) {
+    fout.close();
+  }
+}
+
+void BRepFileWriter::add_solid(const TopoDS_Shape &solid) {
+  if (format != BRepFormat::stream) {
+    BRep_Builder builder;
+    builder.Add(solids, solid);
+    return;
+  }
+  // The size is patched once the record is written
+  uint64_t size = 0;
+  std::streamoff start = fout.tellp();
+  fout.write(reinterpret_cast<const char*>(&size), sizeof(size));
+  BinTools::Write(solid, fout);
+  std::streamoff end = fout.tellp();
+  size = end - start - sizeof(size);
+  fout.seekp(start);
+  fout.write(reinterpret_cast<const char*>(&size), sizeof(size));
+  fout.seekp(end);
+  if (!fout) {
+    throw std::runtime_error("can't write " + path.string());
+  }
+}
+
+void BRepFileWriter::close() {
+  closed = true;
+  if (format == BRepFormat::stream) {
+    fout.close();
+  } else {
+    write_brep(solids, path, format);
+    solids.Nullify();
+  }
+}
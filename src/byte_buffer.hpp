@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+// Minimal binary (de)serialization of trivially copyable values and
+// length-prefixed strings, used for worker messages and cache entries.
+namespace byte_buffer {
+
+template<typename T>
+void put(std::string &buf, const T &value) {
+  buf.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+inline void put_string(std::string &buf, const std::string &str) {
+  put(buf, static_cast<uint64_t>(str.size()));
+  buf.append(str);
+}
+
+struct Cursor
+{
+  const std::string &buf;
+  size_t pos = 0;
+
+  template<typename T>
+  T get() {
+    if (pos + sizeof(T) > buf.size()) {
+      throw std::runtime_error("truncated buffer");
+    }
+    T value;
+    std::memcpy(&value, buf.data()+pos, sizeof(T));
+    pos += sizeof(T);
+    return value;
+  }
+
+  std::string get_string() {
+    auto size = get<uint64_t>();
+    if (size > buf.size() - pos) {
+      throw std::runtime_error("truncated buffer");
+    }
+    std::string str = buf.substr(pos, size);
+    pos += size;
+    return str;
+  }
+};
+
+} // namespace byte_buffer
@@ -1,3 +1,5 @@
+#include <set>
+
 #include "common.hpp"
 
 std::map<std::string, bool> is_required = {
@@ -9,56 +11,223 @@ std::map<std::string, bool> is_required = {
   { "--brep", false },
   { "--log_fails", false },
   { "--no_nurbs", false },
-  { "--no_stl", false }
+  { "--no_stl", false },
+  { "--jobs", false },
+  { "--isolate", false },
+  { "--solid_timeout", false },
+  { "--solid_memory", false },
+  { "--nurbs_version", false },
+  { "--stream", false },
+  { "--deflection", false },
+  { "--lod", false },
+  { "--mesh", false },
+  { "--metrics", false },
+  { "--batch", false },
+  { "--batch_jobs", false },
+  { "--batch_memory", false },
+  { "--cache_dir", false },
+  { "--progress", false },
+  { "--brep_format", false },
+  { "--parallel_read", false },
+  { "--preflight", false },
+  { "--calibration", false }
+};
+
+// Options that consume the next command-line token as their value
+std::set<std::string> with_value = {
+  "--file_path",
+  "--save_dir",
+  "--jobs",
+  "--solid_timeout",
+  "--solid_memory",
+  "--nurbs_version",
+  "--deflection",
+  "--lod",
+  "--metrics",
+  "--batch",
+  "--batch_jobs",
+  "--batch_memory",
+  "--cache_dir",
+  "--progress",
+  "--brep_format",
+  "--calibration"
 };
 
 const char help_message_cstr[] = 
 R"(OCCT STEP Reader
 ------------------------------------------------------------
 Reads and parses STEP or .brep files, tesselates solid 
-watertight parts and export as .stl file, specific for
-each solid. Also, converts all geometry to bspline curves
+watertight parts and export as binary .stl file, specific
+for each solid. Also, converts all geometry to bspline curves
 ans surfaces and exports as .nurbs (poprietary LiteRT format) 
 file, one for the whole model.
 ------------------------------------------------------------
 !!! Required Arguments:
 * --file_path <path> - path to original file
-(Supported extensions: .step, .stp, .brep);
+(Supported extensions: .step, .stp, .brep, .brepstream),
+not needed with --batch;
 * --save_dir <path> - directory to save output files;
 ------------------------------------------------------------
 Optional:
 * --no_nurbs: disable .nurbs file generation
 * --no_stl: disable .stl files generation
-* --brep_no_trim: additionally save .brep file after
-convertation of all faces to bspline surface,
-except trimming curves;
+* --nurbs_version <200|300>: format of the .nurbs file.
+200 (default) is a flat stream of surfaces, 300 adds
+a header and solid/face offset tables for random 
+access (see src/nurbs_format.hpp and the header-only
+reader src/nurbs_reader.hpp). In 300, repeated instances
+of a part reference the surfaces of its first instance;
+* --deflection <ratio>: meshing chord tolerance as a
+fraction of each solid's bounding box diagonal 
+(default: 0.001), so parts of any size get a similar
+level of detail;
+* --lod <N>: write N levels of detail for each solid,
+every level 4 times coarser than the previous one.
+Every level is a separate mesh of the solid, plus a copy
+of it for each coarser level, so N levels cost about N
+meshings;
+* --mesh: write the triangulations of all solids to a 
+single indexed <filename>.mesh file (welded vertices,
+per-solid ranges, see src/mesh_format.hpp) instead of
+one .stl file per solid;
+* --brep_no_trim: additionally save .brep file with an
+untrimmed face for every converted bspline surface, over
+its whole parameter domain. The faces are built from the
+surfaces of the .nurbs output. With --brep, both take
+the surfaces of the --brep conversion, so faces are only
+converted once;
 * --brep: additionally save .brep file after convertation 
 of all faces to bspline surfaces, including trimming 
 curves;
 * --log_fails: save dumps of failed to convert solids 
   and their error messages;
+* --brep_format <ascii|binary|stream>: format of the
+.brep outputs (--brep, --brep_no_trim, --log_fails).
+ascii (default) is the BRepTools text format, binary
+the OCCT BinTools format (smaller and much faster to
+write and read). stream appends every converted solid
+to the file as soon as it is done, as a sequence of
+BinTools records, instead of keeping the whole model in
+memory until the end (see src/brep_io.cpp). This is a
+container of this program, not a file stock OCCT tools
+can open, so these outputs are named .brepstream
+instead of .brep (Fails/ dumps stay plain BinTools .brep
+files). Stream records share no geometry: every instance of a part
+stores it again, so assemblies with many instances get
+much larger files, and read back the instances are
+separate parts. .brep and .brepstream input
+files may be in any of these formats, it is detected
+automatically;
+* --stream: transfer STEP roots one at a time, process
+and release each of them before the next one, so peak
+memory is bounded by the largest root instead of the
+whole model. Memory usage is reported for every root;
+* --parallel_read: parse STEP files on <N> (see --jobs)
+threads: the file is memory-mapped and its DATA section
+split into chunks tokenized concurrently, then loaded by
+the standard STEP tools. Files using anything this parser
+does not support (scopes, strings spanning lines, several
+DATA sections, syntax errors) are read by the standard
+reader, with a message giving the reason. Experimental:
+check that bench/step_read_bench reads the same models
+on representative files before relying on it;
+* --metrics <file.json>: record wall and CPU time, RSS
+growth and bytes written for every stage (read, transfer,
+index, process, write) and every solid (mesh, convert,
+output), faces by surface type, pole and knot counts
+(converted, and of the original B-spline surfaces),
+failure reasons, solids reusing earlier work (instances,
+cache hits), the slowest solids and the peak RSS of the
+run. With --jobs, the RSS growth of a solid includes
+what the other solids processed meanwhile allocated;
+* --preflight: only scan the STEP file (tokenized like
+--parallel_read, nothing is transferred) and write an
+estimate of the run with the other options to
+<filename>_preflight.json: solids, faces by surface type,
+B-spline control points, load, meshing and conversion
+time, peak RSS and failed solids. Files the scan does
+not support are estimated from their size only, flagged
+with "size_only";
+* --calibration <metrics.json|directory>: with
+--preflight, fit the estimate to the --metrics files of
+earlier runs with the same options instead of built-in
+costs (see src/preflight.cpp);
+* --cache_dir <path>: cache the .nurbs block, meshes and
+failure status of every solid in <path>, keyed on a hash
+of its geometry, placement and the meshing/conversion
+options. Re-runs only recompute solids that changed and
+report cache hits and misses. Not used with --brep or 
+--brep_no_trim;
+* --progress <quiet|tty|json>: console output. tty 
+(default) keeps a status line with the current stage,
+solid and face counts and throughput, redrawn in place
+at most 10 times per second (printed as lines, once per
+second, when stdout is redirected); json prints stages,
+messages, errors and progress as JSON lines; quiet only
+prints errors;
+* --jobs <N>: number of worker threads used to tesselate
+and convert solids (default: 1). Output files are
+identical to a single-threaded run;
+* --isolate: process solids in <N> (see --jobs) forked
+worker processes. A solid that crashes or overruns its
+budget is logged as failed and its worker is respawned;
+* --solid_timeout <seconds>: with --isolate, wall-clock
+limit for a single solid;
+* --solid_memory <MB>: with --isolate, limit of the
+memory a worker allocates itself while processing a
+single solid. The model pages it shares with the
+supervisor since the fork are not counted;
+* --batch <manifest|directory|->: convert many models in
+one process. Models are read from a manifest (a path per
+line), found in a directory, or read from stdin as they
+arrive ("-"). Each model is written into its own
+subdirectory of --save_dir, batch_status.tsv lists the 
+result of every model;
+* --batch_jobs <N>: with --batch, number of models 
+processed concurrently (default: 1). Must be 1 with
+--isolate;
+* --batch_memory <MB>: with --batch, new models are only
+started while the process RSS leaves room for them;
 * --help or -h: description of the command-line options
 understood by OCCT STEP Reader.
 
-Arguments can be combined without any restriction. If 
---help or -h specified, only help message will be printed
-without output of any files.
+Arguments can be combined, with these restrictions:
+--isolate requires --batch_jobs 1; --preflight takes a
+single .step or .stp --file_path, not --batch, and
+writes no other output; --cache_dir is not used with
+--brep or --brep_no_trim; --calibration, --solid_timeout,
+--solid_memory, --batch_jobs and --batch_memory only
+apply with the option they refine. If --help or -h
+specified, only help message will be printed without
+output of any files.
 ------------------------------------------------------------
 Output files:
 * <number>.stl, <filename>.nurbs - .stl for <number>-th 
 solid part & .nurbs for the whole model
+* <number>_lod<level>.stl (Optional) - coarser levels of
+detail for "--lod" argument;
+* <filename>.mesh, <filename>_lod<level>.mesh (Optional) -
+all meshes of the model for "--mesh" argument, 
+replacing the .stl files;
 * <filename>_conv_notrim.brep (Optional) - output for 
 "--brep_no_trim" argument;
 * <filename>_conv.brep (Optional) - output for "--brep" argument;
+  both are .brepstream with "--brep_format stream";
 * Fails/<number>.brep (Optional) - dump of <number>-th 
 failed solid;
 * Fails/fails.txt (Optional) - error messages for each
 failed solid.
+* <filename>_preflight.json (Optional) - estimate of the
+run for "--preflight" argument, no other output;
+* batch_status.tsv (Optional) - file, status, seconds,
+solids count and error message of every model in 
+"--batch" mode.
 )";
 
 void get_cl_args(
     int argc, const char **argv,
     std::map<std::string, bool> &is_specified,
+    std::map<std::string, std::string> &values,
     std::filesystem::path &file_path,
     std::filesystem::path &save_dir) {
   is_specified = {
@@ -70,7 +239,26 @@ void get_cl_args(
     { "--brep", false },
     { "--log_fails", false },
     { "--no_nurbs", false },
-    { "--no_stl", false }
+    { "--no_stl", false },
+    { "--jobs", false },
+    { "--isolate", false },
+    { "--solid_timeout", false },
+    { "--solid_memory", false },
+    { "--nurbs_version", false },
+    { "--stream", false },
+    { "--deflection", false },
+    { "--lod", false },
+    { "--mesh", false },
+    { "--metrics", false },
+    { "--batch", false },
+    { "--batch_jobs", false },
+    { "--batch_memory", false },
+    { "--cache_dir", false },
+    { "--progress", false },
+    { "--brep_format", false },
+    { "--parallel_read", false },
+    { "--preflight", false },
+    { "--calibration", false }
   };
 
   for (int i = 1; i < argc; ++i) {
@@ -79,18 +267,24 @@ void get_cl_args(
       throw std::invalid_argument(std::string("invalid argument: ")+arg);
     }
     is_specified[arg] = true;
-    if (arg == "--file_path") {
-      file_path = argv[i+1];
-      ++i;
-    }
-    if (arg == "--save_dir") {
-      save_dir = argv[i+1];
+    if (with_value.count(arg)) {
+      if (i+1 >= argc) {
+        throw std::invalid_argument(arg+" requires a value");
+      }
+      values[arg] = argv[i+1];
       ++i;
     }
   }
+  if (values.count("--file_path")) {
+    file_path = values["--file_path"];
+  }
+  if (values.count("--save_dir")) {
+    save_dir = values["--save_dir"];
+  }
   if (!is_specified["--help"] && !is_specified["-h"]) {
     for (auto &[arg, is_req]: is_required) {
-      if (is_req && !is_specified[arg]) {
+      // In batch mode the models come from --batch
+      if (is_req && !is_specified[arg] && !(arg == "--file_path" && is_specified["--batch"])) {
         throw std::invalid_argument(arg+" is not specified");
       }
     }
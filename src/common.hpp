@@ -1,16 +1,31 @@
 #include <map>
+#include <array>
+#include <ctime>
 #include <filesystem>
 #include <string>
 #include <thread>
 #include <ranges>
 #include <type_traits>
 #include <optional>
+#include <sstream>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+#include <atomic>
+#include <exception>
+#include <condition_variable>
 
 #include "occt_headers.hpp"
+#include "nurbs_format.hpp"
+#include "mesh_format.hpp"
+#include "event_queue.hpp"
 
 void get_cl_args(
     int argc, const char **argv,
     std::map<std::string, bool> &is_specified,
+    std::map<std::string, std::string> &values,
     std::filesystem::path &file_path,
     std::filesystem::path &save_dir);
 std::string help_message();
@@ -23,17 +38,103 @@ protected:
                      const Standard_Boolean isForce) override {}
 };
 
-inline
-void progress_bar(Message_ProgressIndicator &indicator, std::string message) {
-  while((1.0 - indicator.GetPosition()) > 1e-4) {
-    std::cout << '\r' << message << " " << indicator.GetPosition()*100 << "               " << std::flush;
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+// Console output of a run (--progress): a status line redrawn in place,
+// JSON lines, or errors only
+enum class ProgressMode { quiet, tty, json };
+
+struct ProgressEvent
+{
+  enum Kind { message, error, stage };
+  Kind kind = message;
+  int solid_id = -1;
+  std::string text;
+};
+
+// Solid and face counters of the threads sharing a slot, on their own
+// cache line
+struct alignas(64) ProgressCounters
+{
+  std::atomic<uint64_t> solids_total{0}, solids_done{0}, failed_solids{0};
+  std::atomic<uint64_t> faces_total{0}, faces_done{0}, faces_converted{0}, failed_faces{0};
+};
+
+// Worker threads never touch the console. They bump counters in the slot
+// of their thread and push messages, errors and stages into a lock-free
+// queue. A single reporter thread drains the queue, sums the counters of
+// all slots and redraws at most refresh_rate times per second, or earlier
+// when the queue is full. While the reporter is not running (or in forked
+// workers, see detach()) messages and errors are written directly.
+class Reporter
+{
+public:
+  static constexpr int refresh_rate = 10;
+  static constexpr size_t counter_slots = 64;
+
+  ~Reporter();
+  void start(ProgressMode mode);
+  // Drains the queue, prints the final status and joins the thread
+  void stop();
+  // For forked children, which have no reporter thread
+  void detach();
+  ProgressMode progress_mode() const { return mode; }
+
+  void message(std::string text);
+  void error(int solid_id, std::string text);
+  void add_solids(uint64_t solids, uint64_t faces);
+  void solid_done(int solid_id, uint64_t faces, bool failed);
+  void face_done(bool failed);
+  // The position of the indicator, if any, is shown until end_stage()
+  void begin_stage(const std::string &name, const Message_ProgressIndicator *indicator = nullptr);
+  void end_stage(const Message_ProgressIndicator *indicator);
+
+private:
+  void push(ProgressEvent &event);
+  ProgressCounters &counters();
+  void run();
+  void apply(ProgressEvent &event);
+  void print(const std::string &line, bool to_stderr);
+  void draw(bool final);
+
+  ProgressMode mode = ProgressMode::tty;
+  bool terminal = false;
+  std::atomic<bool> running{false}, detached{false};
+  EventQueue<ProgressEvent> queue{1 << 16};
+  std::thread thread;
+  std::mutex mutex;             // guards stopping, drain and indicator
+  std::condition_variable wakeup;
+  bool stopping = false;
+  bool drain = false;           // the queue is full
+  const Message_ProgressIndicator *indicator = nullptr;
+  std::array<ProgressCounters, counter_slots> slots;
+  std::atomic<size_t> next_slot{0};
+
+  // Owned by the reporter thread
+  std::string stage;
+  std::chrono::steady_clock::time_point started;
+  std::string last_status;
+  size_t status_width = 0;
+};
+
+Reporter &reporter();
+
+// Shows a stage for the lifetime of the scope, also when it is left by
+// an exception
+class ProgressStage
+{
+public:
+  explicit ProgressStage(const std::string &name, const Message_ProgressIndicator *indicator = nullptr)
+    : indicator(indicator) {
+    reporter().begin_stage(name, indicator);
   }
-  if (true)
-    std::cout << "\r" << message << " Done.                 " << std::endl;
-  else 
-    std::cout << "\r" << message << "Failed.                " << std::endl;
-}
+  ~ProgressStage() { reporter().end_stage(indicator); }
+  ProgressStage(const ProgressStage&) = delete;
+  ProgressStage &operator=(const ProgressStage&) = delete;
+private:
+  const Message_ProgressIndicator *indicator;
+};
+
+// Quoted and escaped JSON string
+std::string json_string(const std::string &value);
 
 constexpr std::array geom_abs2str = {
   "GeomAbs_Plane",
@@ -55,11 +156,376 @@ struct Statistics
   std::vector<std::pair<std::string, TopoDS_Solid>> failed_solids;
 };
 
-void tesselate_solid(const TopoDS_Solid& shape, std::filesystem::path save_path);
+// Wall and CPU time (seconds) spent in a stage and the change of the
+// process RSS (bytes) over it. With --jobs the RSS change also counts
+// what concurrent solids allocated or freed meanwhile
+struct StageTime
+{
+  double wall = 0;
+  double cpu = 0;
+  int64_t rss_growth = 0;
+};
+
+// Adds the time of its scope to *time, does nothing for nullptr. CPU time
+// is the one of the calling thread, or of the whole process with
+// process_cpu (stages that run worker threads).
+class ScopedTimer
+{
+public:
+  explicit ScopedTimer(StageTime *time, bool process_cpu = false);
+  ~ScopedTimer();
+  ScopedTimer(const ScopedTimer&) = delete;
+  ScopedTimer &operator=(const ScopedTimer&) = delete;
+private:
+  StageTime *time;
+  clockid_t cpu_clock;
+  double wall_start = 0, cpu_start = 0;
+  size_t rss_start = 0;
+};
+
+struct SolidMetrics
+{
+  StageTime mesh, convert, output;
+  uint64_t bytes = 0;                                       // output produced for the solid
+  std::array<uint32_t, geom_abs2str.size()> face_types{};   // original faces by GeomAbs type
+  uint64_t poles = 0, knots = 0;                            // of the converted surfaces
+  uint64_t bspline_poles = 0;                               // of the original B-spline and Bezier surfaces
+  uint32_t failed_faces = 0;                                // skipped by the conversion or --brep_no_trim
+  bool reused = false;                                      // instance or cache hit, computed earlier
+  std::string failure;
+
+  double total_wall() const { return mesh.wall + convert.wall + output.wall; }
+};
+
+struct StageMetrics
+{
+  std::string name;
+  StageTime time;
+  uint64_t bytes = 0;
+};
+
+// Everything recorded for --metrics, solids by solid_id
+struct RunMetrics
+{
+  std::vector<StageMetrics> stages;
+  std::vector<SolidMetrics> solids;
+
+  // Finds the stage by name, appends it on first use
+  StageMetrics &stage(const std::string &name);
+};
+
+void write_metrics(const std::filesystem::path &path, const RunMetrics &metrics, size_t top_n);
+
+// Flat index of the model topology, built in a single traversal: the
+// solids and, in one array, their faces. Faces of a solid are contiguous
+// and in TopExp_Explorer order. Solid ids start from first_id, so a model
+// can also be indexed part by part.
+struct ModelIndex
+{
+  int first_id = 0;
+  std::vector<TopoDS_Solid> solids;
+  std::vector<TopoDS_Face> faces;
+  std::vector<size_t> first_face = { 0 };  // faces of i-th solid: [first_face[i], first_face[i+1])
+
+  // Appends the solids of the shape and their faces
+  void add(const TopoDS_Shape &shape);
+  void clear(int new_first_id);
+
+  int size() const { return static_cast<int>(solids.size()); }
+  int end_id() const { return first_id + size(); }
+  const TopoDS_Solid &solid(int solid_id) const { return solids[solid_id - first_id]; }
+  int face_count(int solid_id) const {
+    return static_cast<int>(first_face[solid_id - first_id + 1] - first_face[solid_id - first_id]);
+  }
+  const TopoDS_Face &face(int solid_id, int i) const {
+    return faces[first_face[solid_id - first_id] + i];
+  }
+};
+
+// B-spline surface of a face, or why the face could not be converted
+struct FaceConversion
+{
+  Handle(Geom_BSplineSurface) surface;
+  std::string failure;
+  // Face over the whole surface, for --brep_no_trim
+  TopoDS_Face untrimmed;
+  std::string untrimmed_failure;
+};
+
+// Formats of the BRep files, see brep_io.cpp
+enum class BRepFormat { ascii, binary, stream };
+
+// What has to be produced for every solid, shared by all workers
+struct PipelineOptions
+{
+  bool nurbs = false;
+  bool stl = false;
+  bool conv_shape = false;
+  bool conv_shape_notrim = false;
+  bool log_fails = false;
+  std::filesystem::path save_dir;
+  int nurbs_version = 200;
+  int jobs = 1;
+  // Supervisor mode: solids are processed in forked worker processes
+  bool isolate = false;
+  double solid_timeout = 0;   // seconds per solid, 0 - unlimited
+  size_t solid_memory = 0;    // bytes of worker RSS, 0 - unlimited
+  // Meshing chord tolerance as a fraction of the solid's bounding box diagonal
+  double deflection = 0.001;
+  // Number of .stl levels of detail, each one lod_ratio times coarser
+  int lod_levels = 1;
+  // Meshes go to one indexed .mesh file per level instead of .stl files
+  bool mesh_container = false;
+  bool metrics = false;
+  std::filesystem::path metrics_path;
+  // Result cache of solids shared by runs, empty - disabled
+  std::filesystem::path cache_dir;
+  // Transfer and process STEP roots one by one
+  bool stream = false;
+  // Parse STEP files on jobs threads, see step_reader.cpp
+  bool parallel_read = false;
+  // Format of the --brep, --brep_no_trim and --log_fails outputs
+  BRepFormat brep_format = BRepFormat::ascii;
+};
+
+// Everything produced for a single solid. Owned by the worker that
+// processed the solid until it is emitted in solid_id order.
+struct SolidOutput
+{
+  std::optional<std::string> nurbs;
+  std::optional<TopoDS_Shape> conv_shape;
+  std::optional<TopoDS_Shape> conv_shape_notrim;
+  std::optional<Statistics> stats;
+  std::optional<std::vector<std::string>> meshes;   // .mesh blocks, one per level of detail
+  std::optional<SolidMetrics> metrics;
+  std::string failure;                      // conversion error, empty on success
+  uint32_t failed_faces = 0;                // skipped by the conversion
+  std::optional<bool> cache_hit;            // set when the result cache was used
+};
+
+size_t nurbs_surface_size(const Geom_BSplineSurface &bspline);
+char *write_nurbs_surface(const Geom_BSplineSurface &bspline, char *out);
+void write_nurbs_solid(const std::vector<Handle(Geom_BSplineSurface)> &surfaces, std::string &out, int version);
+void write_nurbs_instance(int prototype, const gp_Trsf &transform, std::string &out);
+// Prototype of a block written by write_nurbs_instance, -1 for other blocks
+int nurbs_instance_prototype(const std::string &block);
+
+// .nurbs output file, solids are added in solid_id order as blocks
+// produced by write_nurbs_solid (an empty block for a failed solid)
+class NurbsFileWriter
+{
+public:
+  NurbsFileWriter(const std::filesystem::path &path, int version);
+  ~NurbsFileWriter();
+  void add_solid(const std::string &block);
+  void close();
+private:
+  std::filesystem::path path;
+  std::ofstream fout;
+  int version;
+  int exceptions = std::uncaught_exceptions();   // at construction
+  uint64_t offset = 0;
+  std::vector<nurbs_format::NurbsSolidRecord> solids;
+  std::vector<nurbs_format::NurbsFaceRecord> faces;
+};
+
+BRepFormat brep_format(const std::string &name);
+// ".brepstream" for the stream container, which stock OCCT tools can't
+// open, ".brep" otherwise
+std::string brep_extension(BRepFormat format);
+// Reads a BRep file of any of the formats, recognized from its content
+void read_brep(const std::filesystem::path &path, TopoDS_Shape &shape, const Message_ProgressRange &range);
+void write_brep(const TopoDS_Shape &shape, const std::filesystem::path &path, BRepFormat format);
+
+// Parallel STEP parsing, see step_reader.cpp. read_step_parallel() leaves
+// the reader untouched and returns false, with the reason, for files it
+// does not support; read_step() then uses the stock reader
+bool read_step_parallel(
+    STEPControl_Reader &reader,
+    const std::filesystem::path &path,
+    int threads,
+    std::string &reason);
+IFSelect_ReturnStatus read_step(
+    STEPControl_Reader &reader,
+    const std::filesystem::path &path,
+    const PipelineOptions &options);
+
+// Entity counts of a STEP file
+struct StepScan
+{
+  uint64_t entities = 0;
+  // Entities by type, complex ones by their partial types joined with spaces
+  std::map<std::string, uint64_t> types;
+  // Faces (ADVANCED_FACE, FACE_SURFACE) by the type of their surface
+  std::map<std::string, uint64_t> face_surfaces;
+  uint64_t poles = 0;         // control points of B-spline and Bezier surfaces
+};
+
+// Tokenizes the file on threads like read_step_parallel() and counts its
+// entities without loading them. Throws for files it does not support
+StepScan scan_step(const std::filesystem::path &path, int threads);
+
+// BRep output of converted solids. The stream format appends every solid
+// to the file as it is added, the others collect them into a compsolid
+// written on close(). A writer destroyed without close(), i.e. by an
+// exception, writes nothing more.
+class BRepFileWriter
+{
+public:
+  // container is TopAbs_COMPSOLID for solids, TopAbs_COMPOUND for any shape
+  BRepFileWriter(const std::filesystem::path &path, BRepFormat format,
+                 TopAbs_ShapeEnum container = TopAbs_COMPSOLID);
+  ~BRepFileWriter();
+  void add_solid(const TopoDS_Shape &solid);
+  void close();
+private:
+  std::filesystem::path path;
+  BRepFormat format;
+  std::ofstream fout;
+  TopoDS_Shape solids;
+  bool closed = false;
+};
+
+// Work shared by instances of the same part within a run. Solids with the
+// same TShape (whatever their TopLoc_Location) are meshed and converted
+// only once; the first of them in solid_id order is their prototype.
+class InstanceCache
+{
+public:
+  explicit InstanceCache(const ModelIndex &index);
+  int prototype(int solid_id) const { return prototypes[solid_id - index.first_id]; }
+  // Transformation from the prototype's placement to the solid's one
+  gp_Trsf relative_transform(int solid_id) const;
+  // Runs convert() on the unlocated prototype once per TShape, returns the
+  // result placed and oriented like the solid
+  TopoDS_Shape converted(
+    const TopoDS_Shape &solid,
+    const std::function<void(TopoDS_Shape&)> &convert);
+  // Runs convert() on the unlocated prototype once per TShape, returns its
+  // per-face result in the prototype's coordinates
+  const std::vector<FaceConversion> &converted_faces(
+    const TopoDS_Shape &solid,
+    const std::function<std::vector<FaceConversion>(const TopoDS_Shape&)> &convert);
+  // Runs build() on the unlocated prototype once per TShape, returns the
+  // shape it built placed and oriented like the solid
+  TopoDS_Shape untrimmed(
+    const TopoDS_Shape &solid,
+    const std::function<TopoDS_Shape(const TopoDS_Shape&)> &build);
+  // Content hash of the unlocated prototype, computed once per TShape
+  std::string shape_hash(const TopoDS_Shape &solid);
+  // Runs mesh() once per TShape, triangulations are shared by instances
+  void mesh(const TopoDS_Shape &solid, const std::function<void()> &mesh);
+  // Runs mesh() on the unlocated prototype once per TShape, returns the
+  // meshed shapes it produced placed and oriented like the solid
+  std::vector<TopoDS_Shape> meshed(
+    const TopoDS_Shape &solid,
+    const std::function<std::vector<TopoDS_Shape>(const TopoDS_Shape&)> &mesh);
+private:
+  const ModelIndex &index;
+  std::vector<int> prototypes;
+  std::mutex mutex;
+  std::unordered_map<const TopoDS_TShape*, std::shared_future<TopoDS_Shape>> conversions;
+  std::unordered_map<const TopoDS_TShape*, std::shared_future<std::vector<FaceConversion>>> face_conversions;
+  std::unordered_map<const TopoDS_TShape*, std::shared_future<TopoDS_Shape>> untrimmed_shapes;
+  std::unordered_map<const TopoDS_TShape*, std::shared_future<void>> meshes;
+  std::unordered_map<const TopoDS_TShape*, std::shared_future<std::vector<TopoDS_Shape>>> lods;
+  std::unordered_map<const TopoDS_TShape*, std::shared_future<std::string>> hashes;
+};
+
+constexpr double lod_ratio = 4.0;
+
+double solid_deflection(const TopoDS_Shape& shape, double relative_deflection);
+void mesh_solid(const TopoDS_Shape& shape, double deflection);
+std::vector<TopoDS_Shape> mesh_solid_lods(const TopoDS_Shape& shape, double deflection, int levels);
+void export_to_stl(const TopoDS_Shape& shape, std::filesystem::path path);
+void write_mesh_solid(const TopoDS_Shape &solid, std::string &out);
+
+// .mesh output file, solids are added in solid_id order as blocks
+// produced by write_mesh_solid (an empty block for a failed solid)
+class MeshFileWriter
+{
+public:
+  explicit MeshFileWriter(const std::filesystem::path &path);
+  ~MeshFileWriter();
+  void add_solid(const std::string &block);
+  void close();
+private:
+  std::filesystem::path path;
+  std::ofstream fout;
+  int exceptions = std::uncaught_exceptions();   // at construction
+  uint64_t offset = 0;
+  uint64_t vertices = 0, triangles = 0;
+  std::vector<mesh_format::MeshSolidRecord> solids;
+};
+void tesselate_solid(const TopoDS_Solid& shape, double deflection, std::filesystem::path save_path);
 void convert2nurbs(
-      int shape_id, int shapes_total,
-      TopoDS_Solid shape, 
-      std::optional<std::ofstream> &fout,
+      int shape_id,
+      const ModelIndex &index,
+      std::optional<std::string> &fout,
       std::optional<Statistics> &stats,
-      std::optional<TopoDS_CompSolid> &conv_shape,
-      std::optional<TopoDS_CompSolid> &conv_shape_notrim);
\ No newline at end of file
+      std::string &failure,
+      uint32_t &failed_faces,
+      std::optional<TopoDS_Shape> &conv_shape,
+      std::optional<TopoDS_Shape> &conv_shape_notrim,
+      std::optional<SolidMetrics> &metrics,
+      InstanceCache &cache,
+      const PipelineOptions &options);
+void process_solid(
+    int shape_id,
+    const ModelIndex &index,
+    InstanceCache &cache,
+    const PipelineOptions &options,
+    SolidOutput &output);
+void process_solids(
+    const ModelIndex &index,
+    const PipelineOptions &options,
+    const std::function<void(int, SolidOutput&)> &emit);
+void process_solids_isolated(
+    const ModelIndex &index,
+    const PipelineOptions &options,
+    const std::function<void(int, SolidOutput&)> &emit);
+
+// Result cache (--cache_dir): outputs of a solid stored under a hash of
+// its geometry, placement and the options affecting them
+std::string content_hash(const std::string &data);
+std::string result_key(int solid_id, const ModelIndex &index, InstanceCache &cache, const PipelineOptions &options);
+bool load_result(
+    const std::string &key, int solid_id,
+    const ModelIndex &index, InstanceCache &cache,
+    const PipelineOptions &options, SolidOutput &output);
+void store_result(const std::string &key, int solid_id, const PipelineOptions &options, const SolidOutput &output);
+
+// Converts a model into options.save_dir, returns the number of solids.
+// With options.metrics the report goes to options.metrics_path (unless it
+// is empty) and, if collected_metrics is given, is also moved there.
+int process_model(
+    const std::filesystem::path &file_path,
+    const PipelineOptions &options,
+    RunMetrics *collected_metrics = nullptr);
+
+// Batch mode: many models converted by one process
+struct BatchOptions
+{
+  std::string source;         // manifest file, directory or "-" for stdin
+  int jobs = 1;               // models processed concurrently
+  size_t memory = 0;          // bytes of RSS for starting new models, 0 - unlimited
+};
+
+void run_batch(const BatchOptions &batch, const PipelineOptions &options);
+
+// Preflight mode: time and peak memory of a model predicted from a scan of
+// its STEP file, written as JSON to <save_dir>/<filename>_preflight.json. The
+// costs are fitted to the --metrics files found in calibration (a file or
+// a directory), built-in estimates are used without them.
+void preflight(
+    const std::filesystem::path &file_path,
+    const std::filesystem::path &calibration,
+    const PipelineOptions &options);
+
+// Resident memory of a process (this one by default) and the high-water
+// mark of this process, in bytes
+size_t resident_memory(pid_t pid = 0);
+size_t peak_resident_memory();
+// Resident pages of a process not shared with any other, copy-on-write
+// pages inherited on fork and left untouched excluded. 0 if unknown
+size_t private_memory(pid_t pid);
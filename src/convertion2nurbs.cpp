@@ -3,138 +3,252 @@
 
 #include "common.hpp"
 
-template<typename T>
-void binout(std::ostream &fout, const T& value) {
-  fout.write(reinterpret_cast<const char*>(&value), sizeof(T));
+void convert_solid(int shape_id, TopoDS_Shape &shape) {
+  BRepBuilderAPI_NurbsConvert convertor;
+  try {
+    OCC_CATCH_SIGNALS
+    convertor.Perform(shape);
+    shape = convertor.Shape();
+  } catch(Standard_Failure &err) {
+    reporter().error(shape_id, err.GetMessageString());
+    throw;
+  } catch(...) {
+    reporter().error(shape_id, "Unknown");
+    throw;
+  }
 }
 
-void output_nurbs(Geom_BSplineSurface *bspline, std::ostream &fout) {
-  if (bspline->IsUPeriodic()) {
-    bspline->SetUNotPeriodic();
+// Per-face conversion engine. B-spline surfaces are passed through,
+// Bezier and elementary surfaces get their closed-form B-spline form
+// over the face's parametric bounds, only the remaining types go through
+// BRepBuilderAPI_NurbsConvert, of the single face.
+Handle(Geom_BSplineSurface) convert_face(const TopoDS_Face &face) {
+  BRepAdaptor_Surface surface(face);
+  switch (surface.GetType()) {
+  case GeomAbs_BSplineSurface:
+    return surface.BSpline();
+  case GeomAbs_BezierSurface:
+    return GeomConvert::SurfaceToBSplineSurface(surface.Bezier());
+  case GeomAbs_Plane:
+  case GeomAbs_Cylinder:
+  case GeomAbs_Cone:
+  case GeomAbs_Sphere:
+  case GeomAbs_Torus: {
+    double u1, u2, v1, v2;
+    BRepTools::UVBounds(face, u1, u2, v1, v2);
+    Handle(Geom_Surface) trimmed = new Geom_RectangularTrimmedSurface(BRep_Tool::Surface(face), u1, u2, v1, v2);
+    return GeomConvert::SurfaceToBSplineSurface(trimmed);
   }
-  if (bspline->IsVPeriodic()) {
-    bspline->SetVNotPeriodic();
+  default: {
+    BRepBuilderAPI_NurbsConvert convertor(face);
+    return BRepAdaptor_Surface(TopoDS::Face(convertor.Shape())).BSpline();
   }
-
-  int n = bspline->NbUPoles()-1, m = bspline->NbVPoles()-1;
-  binout(fout, n);
-  binout(fout, m);
-
-  for (auto &point: bspline->Poles()) {
-    float point_values[4] = { 
-      static_cast<float>(point.X()), 
-      static_cast<float>(point.Y()), 
-      static_cast<float>(point.Z()), 
-      1.0f 
-    };
-    binout(fout, point_values);
   }
-  
-  if (bspline->Weights() != nullptr) {
-    for (float weight: *bspline->Weights()) {
-      binout(fout, weight);
+}
+
+std::vector<FaceConversion> convert_faces(const TopoDS_Shape &shape, int total) {
+  std::vector<FaceConversion> faces;
+  faces.reserve(total);
+  for (TopExp_Explorer ex(shape, TopAbs_FACE); ex.More(); ex.Next()) {
+    auto &face = TopoDS::Face(ex.Current());
+    auto &result = faces.emplace_back();
+    try {
+      OCC_CATCH_SIGNALS
+      result.surface = convert_face(face);
+    } catch(Standard_Failure &err) {
+      result.surface.Nullify();
+      result.failure = err.GetMessageString();
+    } catch(...) {
+      result.surface.Nullify();
     }
-  } else {
-    for (int i = 0; i < (n+1)*(m+1); ++i) {
-      float weight = 1.0f;
-      binout(fout, weight);
+    if (result.surface.IsNull() && result.failure.empty()) {
+      result.failure = "Unknown";
     }
+    reporter().face_done(result.surface.IsNull());
   }
+  return faces;
+}
 
-  int u_deg = bspline->UDegree(), v_deg = bspline->VDegree();
-  binout(fout, u_deg);
-  binout(fout, v_deg);
-  for (float knot: bspline->UKnotSequence()) {
-    binout(fout, knot);
+// Surfaces of a solid converted by BRepBuilderAPI_NurbsConvert, in
+// TopExp_Explorer order like the faces of the original solid
+std::vector<FaceConversion> converted_solid_faces(const TopoDS_Shape &converted) {
+  std::vector<FaceConversion> faces;
+  for (TopExp_Explorer ex(converted, TopAbs_FACE); ex.More(); ex.Next()) {
+    auto &result = faces.emplace_back();
+    result.surface = Handle(Geom_BSplineSurface)::DownCast(BRep_Tool::Surface(TopoDS::Face(ex.Current())));
+    if (result.surface.IsNull()) {
+      result.failure = "not converted to a B-spline surface";
+    }
   }
-  for (float knot: bspline->VKnotSequence()) {
-    binout(fout, knot);
+  return faces;
+}
+
+// Untrimmed face of every converted surface, over its natural parameter
+// domain, in the coordinates of the surface
+void build_untrimmed_faces(std::vector<FaceConversion> &faces) {
+  for (auto &face: faces) {
+    if (face.surface.IsNull()) {
+      continue;
+    }
+    try {
+      OCC_CATCH_SIGNALS
+      face.untrimmed = BRepBuilderAPI_MakeFace(face.surface, Precision::Confusion()).Face();
+    } catch(Standard_Failure &err) {
+      face.untrimmed_failure = err.GetMessageString();
+    } catch(...) {
+    }
+    if (face.untrimmed.IsNull() && face.untrimmed_failure.empty()) {
+      face.untrimmed_failure = "Unknown";
+    }
   }
 }
 
-void convert_solid(int shape_id, int shapes_total, TopoDS_Shape &shape) {
-  std::string message = std::string("[")
-                      + std::to_string(shape_id+1) 
-                      + "/" 
-                      + std::to_string(shapes_total)
-                      + "] Convert to bspline....";
-  std::cout << message << std::flush;
-  BRepBuilderAPI_NurbsConvert convertor;
-  try {
-    OCC_CATCH_SIGNALS
-    convertor.Perform(shape);
-    shape = convertor.Shape();
-  } catch(Standard_Failure &err) {
-    std::cout << "Failed. Skip." << std::endl;
-    std::cerr << std::to_string(shape_id) + ": " << err << std::endl;
-    throw;
-  } catch(...) {
-    std::cout << "Failed. Skip." << std::endl;
-    std::cerr << std::to_string(shape_id) + ": " << "Unknown" << std::endl;
-    throw;
+TopoDS_Shape untrimmed_compound(const std::vector<FaceConversion> &faces) {
+  TopoDS_Compound compound;
+  BRep_Builder builder;
+  builder.MakeCompound(compound);
+  for (auto &face: faces) {
+    if (!face.untrimmed.IsNull()) {
+      builder.Add(compound, face.untrimmed);
+    }
   }
-  std::cout << "Done." << std::endl;
+  return compound;
 }
 
 void convert2nurbs(
-      int shape_id, int shapes_total,
-      TopoDS_Solid shape, 
-      std::optional<std::ofstream> &fout,
+      int shape_id,
+      const ModelIndex &index,
+      std::optional<std::string> &fout,
       std::optional<Statistics> &stats,
-      std::optional<TopoDS_CompSolid> &conv_shape,
-      std::optional<TopoDS_CompSolid> &conv_shape_notrim) {
-  BRep_Builder builder;
-
-  int count = 0, total = 0;
-  for (TopExp_Explorer ex(shape, TopAbs_FACE); ex.More(); ex.Next()) { ++total; }
+      std::string &failure,
+      uint32_t &failed_faces,
+      std::optional<TopoDS_Shape> &conv_shape,
+      std::optional<TopoDS_Shape> &conv_shape_notrim,
+      std::optional<SolidMetrics> &metrics,
+      InstanceCache &cache,
+      const PipelineOptions &options) {
+  const TopoDS_Solid &shape = index.solid(shape_id);
 
   std::vector<std::string> fails;
-  std::vector<std::pair<std::string, TopoDS_Solid>> failed_solids;
-
-  try {
-    OCC_CATCH_SIGNALS
-    convert_solid(shape_id, shapes_total, shape);
-  } catch(Standard_Failure &err) {
-    fails.push_back(std::to_string(shape_id)+": "+err.GetMessageString());
-    failed_solids.push_back({std::to_string(shape_id)+".brep", shape});
-  } catch(...) {
-    fails.push_back(std::to_string(shape_id)+": "+"Unknown");
-    failed_solids.push_back({std::to_string(shape_id)+".brep", shape});
+  failed_faces = 0;
+  auto fail = [&](const std::string &message) {
+    fails.push_back(std::to_string(shape_id)+": "+message);
+  };
+
+  // The .brep output keeps the topology, so the whole solid is converted
+  std::string trimmed_failure;
+  if (conv_shape) {
+    try {
+      OCC_CATCH_SIGNALS
+      ScopedTimer timer(metrics ? &metrics.value().convert : nullptr);
+      conv_shape = cache.converted(shape, [&](TopoDS_Shape &prototype) {
+        convert_solid(shape_id, prototype);
+      });
+    } catch(Standard_Failure &err) {
+      trimmed_failure = err.GetMessageString();
+      if (trimmed_failure.empty()) {
+        trimmed_failure = "Unknown";
+      }
+    } catch(...) {
+      trimmed_failure = "Unknown";
+    }
   }
 
-  if (fout && !fails.size()) {
-    std::ofstream &out = fout.value();
-    binout(out, total);
-    for (TopExp_Explorer ex(shape, TopAbs_FACE); ex.More(); ex.Next()) {
-      TopoDS_Face face = TopoDS::Face(ex.Current());
-      BRepAdaptor_Surface surface(face);
-      auto type = surface.GetType();
-      assert(type == GeomAbs_BSplineSurface);
+  // Surfaces for the .nurbs and the untrimmed outputs: those of the .brep
+  // conversion when there is one, otherwise converted face by face. A face
+  // that can not be converted is skipped, the solid only fails if none can
+  if (fout || conv_shape_notrim) {
+    const std::vector<FaceConversion> *faces = nullptr;
+    {
+      ScopedTimer timer(metrics ? &metrics.value().convert : nullptr);
+      faces = &cache.converted_faces(shape, [&](const TopoDS_Shape &prototype) {
+        std::vector<FaceConversion> result;
+        if (conv_shape && trimmed_failure.empty()) {
+          // Converted above, in the coordinates of the prototype
+          result = converted_solid_faces(cache.converted(prototype, [](TopoDS_Shape&) {}));
+          if (static_cast<int>(result.size()) == index.face_count(shape_id)) {
+            for (auto &face: result) {
+              reporter().face_done(face.surface.IsNull());
+            }
+          } else {
+            result.clear();
+          }
+        }
+        if (result.empty()) {
+          result = convert_faces(prototype, index.face_count(shape_id));
+        }
+        if (conv_shape_notrim) {
+          build_untrimmed_faces(result);
+        }
+        return result;
+      });
+    }
+    assert(static_cast<int>(faces->size()) == index.face_count(shape_id));
+
+    ScopedTimer timer(metrics ? &metrics.value().output : nullptr);
+    std::vector<Handle(Geom_BSplineSurface)> surfaces;
+    surfaces.reserve(faces->size());
+    gp_Trsf placement = shape.Location().Transformation();
+    uint32_t untrimmed_failures = 0;
+    for (size_t i = 0; i < faces->size(); ++i) {
+      auto &face = (*faces)[i];
+      if (face.surface.IsNull()) {
+        fail("face " + std::to_string(i) + ": " + face.failure);
+        ++failed_faces;
+        continue;
+      }
+      if (conv_shape_notrim && face.untrimmed.IsNull()) {
+        // Only missing from the untrimmed output
+        fail("face " + std::to_string(i) + ": untrimmed face: " + face.untrimmed_failure);
+        ++untrimmed_failures;
+      }
+      Handle(Geom_BSplineSurface) surface = face.surface;
+      if (metrics) {
+        auto &metrics_ref = metrics.value();
+        metrics_ref.poles += uint64_t(surface->NbUPoles()) * surface->NbVPoles();
+        metrics_ref.knots += surface->UKnotSequence().Length() + surface->VKnotSequence().Length();
+      }
+      if (!fout) {
+        continue;
+      }
+      if (placement.Form() != gp_Identity) {
+        surface = Handle(Geom_BSplineSurface)::DownCast(surface->Transformed(placement));
+      }
+      surfaces.push_back(surface);
+    }
 
-      std::cout << "[" << (shape_id+1)  << "/" << shapes_total << ", " 
-                << (count+1)*100.0f/total << "%] Output " << count 
-                << " face(" << geom_abs2str[type] << ")..." << std::flush;
-      ++count;
-      auto bspline_handler = surface.BSpline();
-      auto bspline = bspline_handler.get();
-      if (fout) {
-        output_nurbs(bspline, fout.value());
+    int prototype = cache.prototype(shape_id);
+    if (failed_faces == faces->size() && !faces->empty()) {
+      failure = faces->front().failure;
+    } else {
+      if (fout && options.nurbs_version == 300 && prototype != shape_id) {
+        // Instance record pointing at the surfaces of the prototype
+        write_nurbs_instance(prototype, cache.relative_transform(shape_id), fout.value());
+      } else if (fout) {
+        write_nurbs_solid(surfaces, fout.value(), options.nurbs_version);
+      }
+      // Faces over the same surfaces, shared by the instances of the part
+      if (conv_shape_notrim) {
+        conv_shape_notrim = cache.untrimmed(shape, [&](const TopoDS_Shape &) {
+          return untrimmed_compound(*faces);
+        });
       }
-      std::cout << "Done." << std::endl;
     }
+    failed_faces += untrimmed_failures;
   }
 
-  if (conv_shape && !fails.size()) {
-    builder.Add(conv_shape.value(), shape);
+  if (!trimmed_failure.empty()) {
+    failure = trimmed_failure;
+    fail(failure);
   }
 
-  if (conv_shape_notrim && !fails.size()) {
-    //TODO
+  if (metrics) {
+    metrics.value().failure = failure;
+    metrics.value().failed_faces = failed_faces;
   }
-
-  if (stats) {
+  if (stats && fails.size()) {
     auto &stats_ref = stats.value();
     std::copy(fails.begin(), fails.end(), std::back_inserter(stats_ref.fails));
-    std::copy(failed_solids.begin(), failed_solids.end(), std::back_inserter(stats_ref.failed_solids));
+    stats_ref.failed_solids.push_back({std::to_string(shape_id)+".brep", shape});
   }
-}
\ No newline at end of file
+}
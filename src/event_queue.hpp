@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+// Bounded lock-free queue for many producers and a single consumer
+// (Vyukov's array queue). Every cell carries a sequence number saying
+// whether it is free for the producer of a given position or holds a
+// value for the consumer, so producers only contend on the tail counter
+// and never wait for each other or for the consumer unless it is full.
+template<typename T>
+class EventQueue
+{
+public:
+  // capacity must be a power of two
+  explicit EventQueue(size_t capacity)
+    : cells(new Cell[capacity]), mask(capacity - 1) {
+    for (size_t i = 0; i < capacity; ++i) {
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  EventQueue(const EventQueue&) = delete;
+  EventQueue &operator=(const EventQueue&) = delete;
+
+  // Moves value in, leaves it untouched and returns false if full
+  bool try_push(T &value) {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    while (true) {
+      Cell &cell = cells[pos & mask];
+      size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          cell.value = std::move(value);
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Only called by the consumer thread
+  bool try_pop(T &value) {
+    Cell &cell = cells[head & mask];
+    size_t sequence = cell.sequence.load(std::memory_order_acquire);
+    if (static_cast<intptr_t>(sequence) - static_cast<intptr_t>(head + 1) < 0) {
+      return false;
+    }
+    value = std::move(cell.value);
+    cell.sequence.store(head + mask + 1, std::memory_order_release);
+    ++head;
+    return true;
+  }
+
+private:
+  struct Cell
+  {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  std::unique_ptr<Cell[]> cells;
+  size_t mask;
+  alignas(64) std::atomic<size_t> tail{0};
+  alignas(64) size_t head = 0;
+};
@@ -0,0 +1,111 @@
+#include "common.hpp"
+
+InstanceCache::InstanceCache(const ModelIndex &index)
+  : index(index), prototypes(index.size()) {
+  std::unordered_map<const TopoDS_TShape*, int> first;
+  for (int i = 0; i < index.size(); ++i) {
+    auto key = index.solids[i].TShape().get();
+    prototypes[i] = first.emplace(key, index.first_id + i).first->second;
+  }
+}
+
+gp_Trsf InstanceCache::relative_transform(int solid_id) const {
+  auto &base = index.solid(prototype(solid_id));
+  return index.solid(solid_id).Location().Transformation()
+       * base.Location().Transformation().Inverted();
+}
+
+// Runs work() for the first caller with a given TShape; concurrent and
+// later callers wait for it and get the same result (or exception).
+template<typename T>
+static std::shared_future<T> once(
+    std::mutex &mutex,
+    std::unordered_map<const TopoDS_TShape*, std::shared_future<T>> &results,
+    const TopoDS_TShape *key,
+    const std::function<T()> &work) {
+  std::promise<T> promise;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = results.find(key);
+    if (it != results.end()) {
+      return it->second;
+    }
+    results.emplace(key, promise.get_future().share());
+  }
+  try {
+    if constexpr (std::is_void_v<T>) {
+      work();
+      promise.set_value();
+    } else {
+      promise.set_value(work());
+    }
+  } catch(...) {
+    promise.set_exception(std::current_exception());
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  return results[key];
+}
+
+TopoDS_Shape InstanceCache::converted(
+    const TopoDS_Shape &solid,
+    const std::function<void(TopoDS_Shape&)> &convert) {
+  auto result = once<TopoDS_Shape>(mutex, conversions, solid.TShape().get(), [&]() {
+    TopoDS_Shape prototype = solid.Located(TopLoc_Location());
+    prototype.Orientation(TopAbs_FORWARD);
+    convert(prototype);
+    return prototype;
+  });
+  return result.get().Located(solid.Location()).Oriented(solid.Orientation());
+}
+
+const std::vector<FaceConversion> &InstanceCache::converted_faces(
+    const TopoDS_Shape &solid,
+    const std::function<std::vector<FaceConversion>(const TopoDS_Shape&)> &convert) {
+  // The shared state is owned by the map, so the reference stays valid
+  return once<std::vector<FaceConversion>>(mutex, face_conversions, solid.TShape().get(), [&]() {
+    TopoDS_Shape prototype = solid.Located(TopLoc_Location());
+    prototype.Orientation(TopAbs_FORWARD);
+    return convert(prototype);
+  }).get();
+}
+
+TopoDS_Shape InstanceCache::untrimmed(
+    const TopoDS_Shape &solid,
+    const std::function<TopoDS_Shape(const TopoDS_Shape&)> &build) {
+  auto result = once<TopoDS_Shape>(mutex, untrimmed_shapes, solid.TShape().get(), [&]() {
+    TopoDS_Shape prototype = solid.Located(TopLoc_Location());
+    prototype.Orientation(TopAbs_FORWARD);
+    return build(prototype);
+  });
+  return result.get().Located(solid.Location()).Oriented(solid.Orientation());
+}
+
+void InstanceCache::mesh(const TopoDS_Shape &solid, const std::function<void()> &mesh) {
+  once<void>(mutex, meshes, solid.TShape().get(), mesh).get();
+}
+
+std::vector<TopoDS_Shape> InstanceCache::meshed(
+    const TopoDS_Shape &solid,
+    const std::function<std::vector<TopoDS_Shape>(const TopoDS_Shape&)> &mesh) {
+  auto result = once<std::vector<TopoDS_Shape>>(mutex, lods, solid.TShape().get(), [&]() {
+    TopoDS_Shape prototype = solid.Located(TopLoc_Location());
+    prototype.Orientation(TopAbs_FORWARD);
+    return mesh(prototype);
+  });
+  std::vector<TopoDS_Shape> placed;
+  for (auto &shape: result.get()) {
+    placed.push_back(shape.Located(solid.Location()).Oriented(solid.Orientation()));
+  }
+  return placed;
+}
+
+std::string InstanceCache::shape_hash(const TopoDS_Shape &solid) {
+  return once<std::string>(mutex, hashes, solid.TShape().get(), [&]() {
+    TopoDS_Shape prototype = solid.Located(TopLoc_Location());
+    prototype.Orientation(TopAbs_FORWARD);
+    // Without triangulations, so the hash does not depend on meshing
+    std::ostringstream out(std::ios::binary);
+    BinTools::Write(prototype, out, false, false, BinTools_FormatVersion_CURRENT);
+    return content_hash(out.str());
+  }).get();
+}
@@ -9,34 +9,17 @@
 #include <iostream>
 #include <map>
 #include <optional>
+#include <memory>
 
 #include "common.hpp"
 
-void process_solid(
-    int shape_id, int shapes_total,
-    const TopoDS_Solid &solid,
-    std::optional<std::ofstream> &nurbs_out,
-    std::optional<std::filesystem::path> stl_out,
-    std::optional<Statistics>& stats,
-    std::optional<TopoDS_CompSolid>& conv_shape,
-    std::optional<TopoDS_CompSolid>& conv_shape_notrim) {
-  if (stl_out) {
-    std::cout << "[" << (shape_id+1) << "/" << shapes_total, "] Tesselate....";
-    auto save_path = stl_out.value();
-    tesselate_solid(solid, save_path);
-    std::cout << "Done.";
-  }
-  if (nurbs_out || conv_shape || conv_shape_notrim) {
-    convert2nurbs(shape_id, shapes_total, solid, nurbs_out, stats, conv_shape, conv_shape_notrim);
-  }
-}
-
 int main(int argc, const char **argv) {
   OSD::SetSignal(false);
   std::filesystem::path file_path, save_dir;
 
   std::map<std::string, bool> is_specified;
-  get_cl_args(argc, argv, is_specified, file_path, save_dir);
+  std::map<std::string, std::string> values;
+  get_cl_args(argc, argv, is_specified, values, file_path, save_dir);
 
   if (is_specified["--help"] 
       || is_specified["-h"]) {
@@ -44,122 +27,101 @@ int main(int argc, const char **argv) {
     return 0;
   }
 
-  std::filesystem::create_directories(save_dir);
-  auto name = file_path.filename();
-  name.replace_extension("");
-
-  std::optional<Statistics> stats;
-  std::optional<std::filesystem::path> stl_path;
-  std::optional<std::ofstream> nurbs_out;
-  std::optional<TopoDS_CompSolid> conv_shape, conv_shape_no_trim;
-  if (is_specified["--log_fails"]) {
-    stats = Statistics{};
-  }
-  if (!is_specified["--no_nurbs"]) {
-    auto nurbs_name = name;
-    nurbs_name.replace_extension(".nurbs");
-    auto nurbs_path = save_dir / nurbs_name;
-    nurbs_out = std::ofstream(nurbs_path, std::ios::binary);
-    nurbs_out.value().write("VERSION 200", 11);
-  }
-  if (is_specified["--brep"]) {
-    conv_shape = TopoDS_CompSolid();
-    BRep_Builder builder;
-    builder.MakeCompSolid(conv_shape.value());
-  }
-  if (is_specified["--brep_no_trim"]) {
-    conv_shape_no_trim = TopoDS_CompSolid();
-    BRep_Builder builder;
-    builder.MakeCompSolid(conv_shape_no_trim.value());
-  }
-
-  if (file_path.extension() == ".step"
-      || file_path.extension() == ".stp") {
-    STEPControl_Reader reader;
-    IFSelect_ReturnStatus stat = reader.ReadFile(file_path.c_str());
-    reader.PrintCheckLoad(true, IFSelect_PrintCount::IFSelect_ListByItem);
-
-    MyProgressIndicator indicator;
-    Message_ProgressRange range = indicator.Start();
-    std::thread progress_th(progress_bar, std::reference_wrapper(indicator), "Transferring roots from step...");
-    reader.TransferRoots(range);
-    progress_th.join(); 
-
-    auto shapes_for_transfer = reader.NbShapes();
-    int solid_id = 0, shapes_total = 0;
-    std::cout << "Counting shapes..." << std::flush;
-    for (int i = 1; i <= shapes_for_transfer; ++i) {
-      auto full_shape = reader.Shape(i);
-      for (TopExp_Explorer ex(full_shape, TopAbs_SOLID); ex.More(); ex.Next()) {
-        ++shapes_total;
-      }
+  PipelineOptions options;
+  options.nurbs = !is_specified["--no_nurbs"];
+  options.stl = !is_specified["--no_stl"];
+  options.conv_shape = is_specified["--brep"];
+  options.conv_shape_notrim = is_specified["--brep_no_trim"];
+  options.log_fails = is_specified["--log_fails"];
+  options.save_dir = save_dir;
+  if (is_specified["--jobs"]) {
+    options.jobs = std::stoi(values["--jobs"]);
+    if (options.jobs <= 0) {
+      options.jobs = std::max(1u, std::thread::hardware_concurrency());
     }
-    std::cout << "Done." << std::endl;
-    for (int i = 1; i <= shapes_for_transfer; ++i) {
-      auto full_shape = reader.Shape(i);
-      for (TopExp_Explorer ex(full_shape, TopAbs_SOLID); ex.More(); ex.Next()) {
-        if (!is_specified["--no_stl"]) {
-          stl_path = save_dir / (std::to_string(solid_id) + ".stl");
-        }
-        process_solid(solid_id,  shapes_total, TopoDS::Solid(ex.Current()), nurbs_out, stl_path, stats, conv_shape, conv_shape_no_trim);
-        ++solid_id;
-      }
+  }
+  if (is_specified["--nurbs_version"]) {
+    options.nurbs_version = std::stoi(values["--nurbs_version"]);
+    if (options.nurbs_version != 200 && options.nurbs_version != 300) {
+      throw std::invalid_argument("--nurbs_version must be 200 or 300");
     }
-  } else if (file_path.extension() == ".brep") {
-    BRep_Builder builder;
-    TopoDS_Shape shape;
-
-    MyProgressIndicator indicator;
-    Message_ProgressRange range = indicator.Start();
-    std::thread progress_th(progress_bar, std::reference_wrapper(indicator), "Reading .brep file...");
-    BRepTools::Read(shape, file_path.c_str(), builder, range);
-    progress_th.join();
-
-    int solid_id = 0, shapes_total = 0;
-    for (TopExp_Explorer ex(shape, TopAbs_SOLID); ex.More(); ex.Next()) { 
-      ++shapes_total;
+  }
+  if (is_specified["--deflection"]) {
+    options.deflection = std::stod(values["--deflection"]);
+    if (options.deflection <= 0) {
+      throw std::invalid_argument("--deflection must be positive");
     }
-    for (TopExp_Explorer ex(shape, TopAbs_SOLID); ex.More(); ex.Next()) {
-      if (!is_specified["--no_stl"]) {
-        stl_path = save_dir / (std::to_string(solid_id) + ".stl");
-      }
-      process_solid(solid_id, shapes_total, TopoDS::Solid(ex.Current()), nurbs_out, stl_path, stats, conv_shape, conv_shape_no_trim);
-      ++solid_id;
+  }
+  if (is_specified["--lod"]) {
+    options.lod_levels = std::stoi(values["--lod"]);
+    if (options.lod_levels <= 0) {
+      throw std::invalid_argument("--lod must be positive");
     }
-  } else {
-    throw std::invalid_argument(
-        std::string("Incorrect format (")
-      + file_path.extension().string()
-      + "). Must be one of { .step, .stp, .brep }");
   }
-
-  if (conv_shape) {
-    std::cout << "Writing converted model to .brep..." << std::flush;
-    auto conv_path = save_dir / (name.string()+"_conv.brep");
-    BRepTools::Write(conv_shape.value(), conv_path.c_str());
-    std::cout << "Done." << std::endl;
+  options.mesh_container = is_specified["--mesh"];
+  options.metrics = is_specified["--metrics"];
+  options.stream = is_specified["--stream"];
+  options.parallel_read = is_specified["--parallel_read"];
+  if (is_specified["--metrics"]) {
+    options.metrics_path = values["--metrics"];
   }
-
-  if (conv_shape_no_trim) {
-    std::cout << "Writing untrimmed converted model to .brep..." << std::flush;
-    auto conv_path = save_dir / (name.string()+"_conv_notrim.brep");
-    BRepTools::Write(conv_shape_no_trim.value(), conv_path.c_str());
-    std::cout << "Done." << std::endl;
+  if (is_specified["--cache_dir"]) {
+    options.cache_dir = values["--cache_dir"];
+  }
+  if (is_specified["--brep_format"]) {
+    options.brep_format = brep_format(values["--brep_format"]);
+  }
+  options.isolate = is_specified["--isolate"];
+  if (is_specified["--solid_timeout"]) {
+    options.solid_timeout = std::stod(values["--solid_timeout"]);
+  }
+  if (is_specified["--solid_memory"]) {
+    options.solid_memory = std::stoull(values["--solid_memory"]) << 20;
   }
 
-  if (is_specified["--log_fails"]) {
-    std::filesystem::create_directories(save_dir / "Fails");
-    auto &stats_ref = stats.value();
-    for (auto &[name, solid]: stats_ref.failed_solids) {
-      auto path = save_dir / "Fails" / name;
-      BRepTools::Write(solid, path.c_str());
+  ProgressMode progress = ProgressMode::tty;
+  if (is_specified["--progress"]) {
+    auto &mode = values["--progress"];
+    if (mode == "quiet") {
+      progress = ProgressMode::quiet;
+    } else if (mode == "json") {
+      progress = ProgressMode::json;
+    } else if (mode != "tty") {
+      throw std::invalid_argument("--progress must be quiet, tty or json");
     }
-    std::ofstream ffails(save_dir / "Fails" / "fails.txt");
-    ffails << "Fails: " << stats_ref.fails.size() << std::endl;
-    for (auto &fail: stats_ref.fails) {
-      ffails << fail << std::endl;
+  }
+
+  reporter().start(progress);
+  int status = 0;
+  try {
+    if (is_specified["--preflight"]) {
+      if (is_specified["--batch"]) {
+        throw std::invalid_argument("--preflight takes a single --file_path, not --batch");
+      }
+      preflight(file_path, values["--calibration"], options);
+    } else if (is_specified["--batch"]) {
+      BatchOptions batch;
+      batch.source = values["--batch"];
+      if (is_specified["--batch_jobs"]) {
+        batch.jobs = std::max(std::stoi(values["--batch_jobs"]), 1);
+      }
+      if (is_specified["--batch_memory"]) {
+        batch.memory = std::stoull(values["--batch_memory"]) << 20;
+      }
+      run_batch(batch, options);
+    } else {
+      process_model(file_path, options);
     }
+    reporter().message("Peak RSS " + std::to_string(peak_resident_memory() >> 20) + " MB");
+  } catch(Standard_Failure &err) {
+    reporter().error(-1, err.GetMessageString());
+    status = 1;
+  } catch(std::exception &err) {
+    reporter().error(-1, err.what());
+    status = 1;
   }
+  // Drains the pending events and ends the status line
+  reporter().stop();
 
-  return 0;
+  return status;
 }
\ No newline at end of file
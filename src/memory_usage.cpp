@@ -0,0 +1,40 @@
+#include <fstream>
+#include <string>
+
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "common.hpp"
+
+size_t resident_memory(pid_t pid) {
+  std::ifstream statm("/proc/" + (pid ? std::to_string(pid) : std::string("self")) + "/statm");
+  size_t total = 0, resident = 0;
+  if (!(statm >> total >> resident)) {
+    return 0;
+  }
+  return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+size_t peak_resident_memory() {
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  // ru_maxrss is in kilobytes on Linux
+  return static_cast<size_t>(usage.ru_maxrss) << 10;
+}
+
+size_t private_memory(pid_t pid) {
+  // Summed over all mappings since Linux 4.14
+  std::ifstream smaps("/proc/" + std::to_string(pid) + "/smaps_rollup");
+  std::string field;
+  size_t kilobytes, total = 0;
+  bool found = false;
+  while (smaps >> field) {
+    if ((field == "Private_Clean:" || field == "Private_Dirty:") && smaps >> kilobytes) {
+      total += kilobytes;
+      found = true;
+    }
+  }
+  return found ? total << 10 : 0;
+}
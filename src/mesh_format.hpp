@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+
+// Layout of the indexed .mesh container (version 100). All values are
+// little-endian, all offsets are absolute file offsets in bytes.
+//
+//   MeshHeader                        - at offset 0
+//   per solid:
+//     float vertices[vertex_count][3] - 16-byte aligned
+//     uint32_t triangles[triangle_count][3]
+//   MeshSolidRecord[solid_count]      - at header.solid_table_offset
+//
+// Vertices shared by the faces of a solid are welded, triangle indices
+// are local to the solid's vertices. Triangles are counter-clockwise
+// seen from outside the solid. A failed solid has no vertices.
+namespace mesh_format {
+
+constexpr char magic[] = "MESH 100";
+constexpr uint32_t version = 100;
+constexpr uint64_t alignment = 16;
+
+struct MeshHeader
+{
+  char magic[16];               // "MESH 100", zero padded
+  uint32_t version;
+  uint32_t header_size;
+  uint64_t solid_count;
+  uint64_t vertex_count;
+  uint64_t triangle_count;
+  uint64_t solid_table_offset;
+  uint64_t reserved;
+};
+
+struct MeshSolidRecord
+{
+  uint64_t vertices_offset;
+  uint64_t triangles_offset;
+  uint32_t vertex_count;
+  uint32_t triangle_count;
+  uint64_t reserved;
+};
+
+static_assert(sizeof(MeshHeader) == 64);
+static_assert(sizeof(MeshSolidRecord) == 32);
+
+constexpr uint64_t align(uint64_t offset) {
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+} // namespace mesh_format
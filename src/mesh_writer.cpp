@@ -0,0 +1,154 @@
+#include <cstring>
+#include <array>
+
+#include "common.hpp"
+
+// Serializer of the .mesh container (see mesh_format.hpp). Workers turn
+// the triangulations of a solid into a block
+//   uint32_t vertex_count, triangle_count
+//   float vertices[vertex_count][3]
+//   uint32_t triangles[triangle_count][3]
+// and MeshFileWriter appends the blocks in solid_id order.
+
+namespace {
+
+// Vertices are welded by their exact float coordinates: nodes of adjacent
+// faces on a shared edge come from the same edge discretization
+struct VertexHash
+{
+  size_t operator()(const std::array<float, 3> &v) const {
+    uint32_t bits[3];
+    std::memcpy(bits, v.data(), sizeof(bits));
+    uint64_t h = bits[0];
+    h = h * 0x9E3779B97F4A7C15ull ^ bits[1];
+    h = h * 0x9E3779B97F4A7C15ull ^ bits[2];
+    return static_cast<size_t>(h ^ (h >> 29));
+  }
+};
+
+} // namespace
+
+void write_mesh_solid(const TopoDS_Shape &solid, std::string &out) {
+  std::vector<std::array<float, 3>> vertices;
+  std::vector<std::array<uint32_t, 3>> triangles;
+  std::unordered_map<std::array<float, 3>, uint32_t, VertexHash> welded;
+  std::vector<uint32_t> nodes;
+  for (TopExp_Explorer ex(solid, TopAbs_FACE); ex.More(); ex.Next()) {
+    auto &face = TopoDS::Face(ex.Current());
+    TopLoc_Location location;
+    auto triangulation = BRep_Tool::Triangulation(face, location);
+    if (triangulation.IsNull()) {
+      continue;
+    }
+    gp_Trsf transform = location.Transformation();
+    nodes.resize(triangulation->NbNodes());
+    for (int i = 1; i <= triangulation->NbNodes(); ++i) {
+      gp_Pnt p = triangulation->Node(i).Transformed(transform);
+      // +0.0f turns -0 into 0, so both weld together
+      std::array<float, 3> v = {
+        static_cast<float>(p.X()) + 0.0f,
+        static_cast<float>(p.Y()) + 0.0f,
+        static_cast<float>(p.Z()) + 0.0f };
+      auto [it, inserted] = welded.emplace(v, static_cast<uint32_t>(vertices.size()));
+      if (inserted) {
+        vertices.push_back(v);
+      }
+      nodes[i-1] = it->second;
+    }
+    bool reversed = face.Orientation() == TopAbs_REVERSED;
+    for (int i = 1; i <= triangulation->NbTriangles(); ++i) {
+      int n1, n2, n3;
+      triangulation->Triangle(i).Get(n1, n2, n3);
+      if (reversed) {
+        std::swap(n2, n3);
+      }
+      std::array<uint32_t, 3> triangle = { nodes[n1-1], nodes[n2-1], nodes[n3-1] };
+      if (triangle[0] == triangle[1] || triangle[1] == triangle[2] || triangle[0] == triangle[2]) {
+        continue;
+      }
+      triangles.push_back(triangle);
+    }
+  }
+
+  size_t offset = out.size();
+  size_t vertices_size = vertices.size()*sizeof(vertices[0]);
+  size_t triangles_size = triangles.size()*sizeof(triangles[0]);
+  out.resize(offset + 2*sizeof(uint32_t) + vertices_size + triangles_size);
+  char *ptr = out.data() + offset;
+  uint32_t counts[2] = { static_cast<uint32_t>(vertices.size()), static_cast<uint32_t>(triangles.size()) };
+  std::memcpy(ptr, counts, sizeof(counts));
+  std::memcpy(ptr + sizeof(counts), vertices.data(), vertices_size);
+  std::memcpy(ptr + sizeof(counts) + vertices_size, triangles.data(), triangles_size);
+}
+
+MeshFileWriter::MeshFileWriter(const std::filesystem::path &path)
+  : path(path), fout(path, std::ios::binary) {
+  if (!fout) {
+    throw std::runtime_error("can't open " + path.string() + " for writing");
+  }
+  // Placeholder, the header is rewritten with the totals on close()
+  mesh_format::MeshHeader header{};
+  fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  offset = sizeof(header);
+}
+
+MeshFileWriter::~MeshFileWriter() {
+  if (!fout.is_open()) {
+    return;
+  }
+  if (std::uncaught_exceptions() > exceptions) {
+    // Left by an exception: the header and solid ranges would describe a
+    // truncated file, which is removed instead
+    fout.close();
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+    return;
+  }
+  close();
+}
+
+void MeshFileWriter::add_solid(const std::string &block) {
+  using namespace mesh_format;
+  MeshSolidRecord solid{};
+  if (block.empty()) {
+    // Failed solid, keeps its slot so solid ids stay valid
+    solid.vertices_offset = solid.triangles_offset = offset;
+    solids.push_back(solid);
+    return;
+  }
+  uint32_t counts[2];
+  std::memcpy(counts, block.data(), sizeof(counts));
+  solid.vertex_count = counts[0];
+  solid.triangle_count = counts[1];
+
+  static const char padding[alignment] = {};
+  uint64_t data_offset = align(offset);
+  fout.write(padding, data_offset - offset);
+  fout.write(block.data() + sizeof(counts), block.size() - sizeof(counts));
+  solid.vertices_offset = data_offset;
+  solid.triangles_offset = data_offset + uint64_t(solid.vertex_count)*3*sizeof(float);
+  offset = data_offset + block.size() - sizeof(counts);
+  vertices += solid.vertex_count;
+  triangles += solid.triangle_count;
+  solids.push_back(solid);
+}
+
+void MeshFileWriter::close() {
+  using namespace mesh_format;
+  MeshHeader header{};
+  std::memcpy(header.magic, magic, sizeof(magic));
+  header.version = mesh_format::version;
+  header.header_size = sizeof(MeshHeader);
+  header.solid_count = solids.size();
+  header.vertex_count = vertices;
+  header.triangle_count = triangles;
+
+  static const char padding[alignment] = {};
+  header.solid_table_offset = align(offset);
+  fout.write(padding, header.solid_table_offset - offset);
+  fout.write(reinterpret_cast<const char*>(solids.data()), solids.size()*sizeof(MeshSolidRecord));
+
+  fout.seekp(0);
+  fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  fout.close();
+}
@@ -0,0 +1,144 @@
+#include <ctime>
+#include <iomanip>
+#include <numeric>
+#include <algorithm>
+
+#include "common.hpp"
+
+namespace {
+
+double seconds(clockid_t clock) {
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+void write_time(std::ostream &out, const StageTime &time) {
+  out << "{\"wall_s\": " << time.wall
+      << ", \"cpu_s\": " << time.cpu
+      << ", \"rss_growth\": " << time.rss_growth << "}";
+}
+
+template<typename Counts>
+void write_face_types(std::ostream &out, const Counts &counts) {
+  out << "{";
+  bool first = true;
+  for (size_t type = 0; type < counts.size(); ++type) {
+    if (counts[type]) {
+      out << (first ? "" : ", ") << json_string(geom_abs2str[type]) << ": " << counts[type];
+      first = false;
+    }
+  }
+  out << "}";
+}
+
+} // namespace
+
+std::string json_string(const std::string &value) {
+  std::ostringstream out;
+  out << '"';
+  for (unsigned char c: value) {
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (c < 0x20) {
+      out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c) << std::dec;
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+  return out.str();
+}
+
+ScopedTimer::ScopedTimer(StageTime *time, bool process_cpu)
+  : time(time), cpu_clock(process_cpu ? CLOCK_PROCESS_CPUTIME_ID : CLOCK_THREAD_CPUTIME_ID) {
+  if (time) {
+    wall_start = seconds(CLOCK_MONOTONIC);
+    cpu_start = seconds(cpu_clock);
+    rss_start = resident_memory();
+  }
+}
+
+ScopedTimer::~ScopedTimer() {
+  if (time) {
+    time->wall += seconds(CLOCK_MONOTONIC) - wall_start;
+    time->cpu += seconds(cpu_clock) - cpu_start;
+    time->rss_growth += static_cast<int64_t>(resident_memory()) - static_cast<int64_t>(rss_start);
+  }
+}
+
+StageMetrics &RunMetrics::stage(const std::string &name) {
+  for (auto &stage: stages) {
+    if (stage.name == name) {
+      return stage;
+    }
+  }
+  auto &stage = stages.emplace_back();
+  stage.name = name;
+  return stage;
+}
+
+void write_metrics(const std::filesystem::path &path, const RunMetrics &metrics, size_t top_n) {
+  std::ofstream out(path);
+  if (!out) {
+    throw std::runtime_error("can't open " + path.string() + " for writing");
+  }
+  out << std::setprecision(6);
+  out << "{\n  \"stages\": [";
+  for (size_t i = 0; i < metrics.stages.size(); ++i) {
+    auto &stage = metrics.stages[i];
+    out << (i ? ",\n" : "\n") << "    {\"name\": " << json_string(stage.name)
+        << ", \"time\": ";
+    write_time(out, stage.time);
+    out << ", \"bytes\": " << stage.bytes << "}";
+  }
+  out << "\n  ],\n"
+      << "  \"peak_rss\": " << peak_resident_memory() << ",\n";
+
+  std::array<uint64_t, geom_abs2str.size()> face_types{};
+  uint64_t failed = 0;
+  for (auto &solid: metrics.solids) {
+    for (size_t type = 0; type < face_types.size(); ++type) {
+      face_types[type] += solid.face_types[type];
+    }
+    failed += !solid.failure.empty();
+  }
+  out << "  \"solid_count\": " << metrics.solids.size() << ",\n"
+      << "  \"failed_solids\": " << failed << ",\n"
+      << "  \"face_types\": ";
+  write_face_types(out, face_types);
+  out << ",\n";
+
+  std::vector<size_t> order(metrics.solids.size());
+  std::iota(order.begin(), order.end(), 0);
+  auto wall = [&](size_t i) { return metrics.solids[i].total_wall(); };
+  top_n = std::min(top_n, order.size());
+  std::partial_sort(order.begin(), order.begin() + top_n, order.end(),
+                    [&](size_t a, size_t b) { return wall(a) > wall(b); });
+  out << "  \"slowest\": [";
+  for (size_t i = 0; i < top_n; ++i) {
+    out << (i ? ", " : "") << "{\"id\": " << order[i] << ", \"wall_s\": " << wall(order[i]) << "}";
+  }
+  out << "],\n";
+
+  out << "  \"solids\": [";
+  for (size_t id = 0; id < metrics.solids.size(); ++id) {
+    auto &solid = metrics.solids[id];
+    out << (id ? ",\n" : "\n") << "    {\"id\": " << id << ", \"mesh\": ";
+    write_time(out, solid.mesh);
+    out << ", \"convert\": ";
+    write_time(out, solid.convert);
+    out << ", \"output\": ";
+    write_time(out, solid.output);
+    out << ", \"bytes\": " << solid.bytes
+        << ", \"faces\": ";
+    write_face_types(out, solid.face_types);
+    out << ", \"poles\": " << solid.poles
+        << ", \"knots\": " << solid.knots
+        << ", \"bspline_poles\": " << solid.bspline_poles
+        << ", \"failed_faces\": " << solid.failed_faces
+        << ", \"reused\": " << (solid.reused ? "true" : "false")
+        << ", \"failure\": " << (solid.failure.empty() ? "null" : json_string(solid.failure)) << "}";
+  }
+  out << "\n  ]\n}\n";
+}
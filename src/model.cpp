@@ -0,0 +1,269 @@
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <vector>
+#include <optional>
+#include <memory>
+
+#include "common.hpp"
+
+// Length of the list of the slowest solids in the --metrics report
+constexpr size_t slowest_solids = 20;
+
+// Converts a single model into options.save_dir, returns the number of
+// processed solids
+int process_model(
+    const std::filesystem::path &file_path,
+    const PipelineOptions &options,
+    RunMetrics *collected_metrics) {
+  auto &save_dir = options.save_dir;
+  std::filesystem::create_directories(save_dir);
+  auto name = file_path.filename();
+  name.replace_extension("");
+
+  std::optional<Statistics> stats;
+  std::optional<RunMetrics> metrics;
+  std::optional<NurbsFileWriter> nurbs_out;
+  std::vector<std::unique_ptr<MeshFileWriter>> mesh_out;
+  std::optional<BRepFileWriter> conv_shape, conv_shape_no_trim;
+  // Files written at the end of the run, for the metrics
+  std::vector<std::filesystem::path> output_files;
+  if (options.log_fails) {
+    stats = Statistics{};
+  }
+  if (options.metrics) {
+    metrics = RunMetrics{};
+    metrics.value().stage("read").bytes = std::filesystem::file_size(file_path);
+  }
+  auto stage_time = [&](const std::string &stage) -> StageTime* {
+    return metrics ? &metrics.value().stage(stage).time : nullptr;
+  };
+  if (options.nurbs) {
+    auto nurbs_name = name;
+    nurbs_name.replace_extension(".nurbs");
+    auto nurbs_path = save_dir / nurbs_name;
+    nurbs_out.emplace(nurbs_path, options.nurbs_version);
+    output_files.push_back(nurbs_path);
+  }
+  if (options.stl && options.mesh_container) {
+    for (int level = 0; level < options.lod_levels; ++level) {
+      auto mesh_name = name.string();
+      if (level > 0) {
+        mesh_name += "_lod" + std::to_string(level);
+      }
+      mesh_out.push_back(std::make_unique<MeshFileWriter>(save_dir / (mesh_name + ".mesh")));
+      output_files.push_back(save_dir / (mesh_name + ".mesh"));
+    }
+  }
+  if (options.conv_shape) {
+    auto conv_path = save_dir / (name.string()+"_conv"+brep_extension(options.brep_format));
+    conv_shape.emplace(conv_path, options.brep_format);
+    output_files.push_back(conv_path);
+  }
+  if (options.conv_shape_notrim) {
+    auto conv_path = save_dir / (name.string()+"_conv_notrim"+brep_extension(options.brep_format));
+    conv_shape_no_trim.emplace(conv_path, options.brep_format, TopAbs_COMPOUND);
+    output_files.push_back(conv_path);
+  }
+
+  int solids = 0, cache_hits = 0, cache_misses = 0;
+  auto emit = [&](int, SolidOutput &output) {
+    ++solids;
+    if (output.cache_hit) {
+      ++(output.cache_hit.value() ? cache_hits : cache_misses);
+    }
+    if (output.nurbs) {
+      nurbs_out.value().add_solid(output.nurbs.value());
+    }
+    if (output.meshes) {
+      for (size_t level = 0; level < mesh_out.size(); ++level) {
+        mesh_out[level]->add_solid(output.meshes.value()[level]);
+      }
+    }
+    if (output.conv_shape && !output.conv_shape.value().IsNull()) {
+      conv_shape.value().add_solid(output.conv_shape.value());
+    }
+    if (output.conv_shape_notrim && !output.conv_shape_notrim.value().IsNull()) {
+      conv_shape_no_trim.value().add_solid(output.conv_shape_notrim.value());
+    }
+    if (output.stats) {
+      auto &stats_ref = stats.value();
+      auto &solid_stats = output.stats.value();
+      std::move(solid_stats.fails.begin(), solid_stats.fails.end(), std::back_inserter(stats_ref.fails));
+      std::move(solid_stats.failed_solids.begin(), solid_stats.failed_solids.end(), std::back_inserter(stats_ref.failed_solids));
+    }
+    if (output.metrics) {
+      metrics.value().stage("process").bytes += output.metrics.value().bytes;
+      metrics.value().solids.push_back(std::move(output.metrics.value()));
+    }
+  };
+
+  ModelIndex index;
+  if ((file_path.extension() == ".step"
+       || file_path.extension() == ".stp")
+      && options.stream) {
+    STEPControl_Reader reader;
+    IFSelect_ReturnStatus stat;
+    {
+      ProgressStage stage("Reading STEP file");
+      ScopedTimer timer(stage_time("read"));
+      stat = read_step(reader, file_path, options);
+    }
+    // The check report goes to the OCCT messenger, not through the reporter
+    if (reporter().progress_mode() == ProgressMode::tty) {
+      reader.PrintCheckLoad(true, IFSelect_PrintCount::IFSelect_ListByItem);
+    }
+    if (stat != IFSelect_RetDone) {
+      throw std::runtime_error("can't read " + file_path.string());
+    }
+    reporter().message("Model loaded, RSS " + std::to_string(resident_memory() >> 20) + " MB");
+
+    // Roots are transferred, processed and released one by one, so only
+    // the shapes of a single root are alive at any moment
+    int roots = reader.NbRootsForTransfer();
+    for (int root = 1; root <= roots; ++root) {
+      {
+        ProgressStage stage("Transferring root " + std::to_string(root) + "/" + std::to_string(roots));
+        ScopedTimer timer(stage_time("transfer"));
+        reader.TransferOneRoot(root);
+      }
+
+      {
+        ScopedTimer timer(stage_time("index"));
+        for (int i = 1; i <= reader.NbShapes(); ++i) {
+          index.add(reader.Shape(i));
+        }
+      }
+      reader.ClearShapes();
+      reader.WS()->TransferReader()->Clear(1);
+      reader.WS()->TransferReader()->TransientProcess()->Clear();
+
+      {
+        ProgressStage stage("Processing root " + std::to_string(root) + "/" + std::to_string(roots));
+        ScopedTimer timer(stage_time("process"), true);
+        process_solids(index, options, emit);
+      }
+      reporter().message(
+        "Root " + std::to_string(root) + "/" + std::to_string(roots) + ": "
+        + std::to_string(index.size()) + " solids, "
+        + "RSS " + std::to_string(resident_memory() >> 20) + " MB, "
+        + "peak RSS " + std::to_string(peak_resident_memory() >> 20) + " MB");
+      index.clear(index.end_id());
+    }
+  } else if (file_path.extension() == ".step"
+      || file_path.extension() == ".stp") {
+    STEPControl_Reader reader;
+    IFSelect_ReturnStatus stat;
+    {
+      ProgressStage stage("Reading STEP file");
+      ScopedTimer timer(stage_time("read"));
+      stat = read_step(reader, file_path, options);
+    }
+    // The check report goes to the OCCT messenger, not through the reporter
+    if (reporter().progress_mode() == ProgressMode::tty) {
+      reader.PrintCheckLoad(true, IFSelect_PrintCount::IFSelect_ListByItem);
+    }
+    if (stat != IFSelect_RetDone) {
+      throw std::runtime_error("can't read " + file_path.string());
+    }
+
+    {
+      MyProgressIndicator indicator;
+      ProgressStage stage("Transferring roots from STEP", &indicator);
+      ScopedTimer timer(stage_time("transfer"));
+      reader.TransferRoots(indicator.Start());
+    }
+
+    auto shapes_for_transfer = reader.NbShapes();
+    {
+      ProgressStage stage("Indexing solids");
+      ScopedTimer timer(stage_time("index"));
+      for (int i = 1; i <= shapes_for_transfer; ++i) {
+        index.add(reader.Shape(i));
+      }
+    }
+    reporter().message(
+      "Indexed " + std::to_string(index.size()) + " solids, "
+      + std::to_string(index.faces.size()) + " faces");
+    ProgressStage stage("Processing solids");
+    ScopedTimer timer(stage_time("process"), true);
+    process_solids(index, options, emit);
+  } else if (file_path.extension() == ".brep" || file_path.extension() == ".brepstream") {
+    TopoDS_Shape shape;
+
+    {
+      MyProgressIndicator indicator;
+      ProgressStage stage("Reading .brep file", &indicator);
+      ScopedTimer timer(stage_time("read"));
+      read_brep(file_path, shape, indicator.Start());
+    }
+
+    {
+      ScopedTimer timer(stage_time("index"));
+      index.add(shape);
+    }
+    ProgressStage stage("Processing solids");
+    ScopedTimer timer(stage_time("process"), true);
+    process_solids(index, options, emit);
+  } else {
+    throw std::invalid_argument(
+        std::string("Incorrect format (")
+      + file_path.extension().string()
+      + "). Must be one of { .step, .stp, .brep, .brepstream }");
+  }
+
+  std::optional<ProgressStage> write_stage;
+  write_stage.emplace("Writing output files");
+  std::optional<ScopedTimer> write_timer;
+  write_timer.emplace(stage_time("write"));
+  if (nurbs_out) {
+    nurbs_out.value().close();
+  }
+  for (auto &mesh: mesh_out) {
+    mesh->close();
+  }
+
+  if (conv_shape) {
+    conv_shape.value().close();
+  }
+  if (conv_shape_no_trim) {
+    conv_shape_no_trim.value().close();
+  }
+
+  if (options.log_fails) {
+    std::filesystem::create_directories(save_dir / "Fails");
+    auto &stats_ref = stats.value();
+    for (auto &[name, solid]: stats_ref.failed_solids) {
+      auto path = save_dir / "Fails" / name;
+      write_brep(solid, path, options.brep_format);
+    }
+    std::ofstream ffails(save_dir / "Fails" / "fails.txt");
+    ffails << "Fails: " << stats_ref.fails.size() << std::endl;
+    for (auto &fail: stats_ref.fails) {
+      ffails << fail << std::endl;
+    }
+  }
+
+  write_timer.reset();
+  write_stage.reset();
+
+  if (metrics) {
+    auto &write_stage = metrics.value().stage("write");
+    for (auto &path: output_files) {
+      write_stage.bytes += std::filesystem::file_size(path);
+    }
+    if (!options.metrics_path.empty()) {
+      write_metrics(options.metrics_path, metrics.value(), slowest_solids);
+    }
+    if (collected_metrics) {
+      *collected_metrics = std::move(metrics.value());
+    }
+  }
+
+  if (!options.cache_dir.empty()) {
+    reporter().message(
+      "Cache: " + std::to_string(cache_hits) + " hits, " + std::to_string(cache_misses) + " misses");
+  }
+
+  return solids;
+}
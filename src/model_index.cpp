@@ -0,0 +1,18 @@
+#include "common.hpp"
+
+void ModelIndex::add(const TopoDS_Shape &shape) {
+  for (TopExp_Explorer ex(shape, TopAbs_SOLID); ex.More(); ex.Next()) {
+    solids.push_back(TopoDS::Solid(ex.Current()));
+    for (TopExp_Explorer fex(ex.Current(), TopAbs_FACE); fex.More(); fex.Next()) {
+      faces.push_back(TopoDS::Face(fex.Current()));
+    }
+    first_face.push_back(faces.size());
+  }
+}
+
+void ModelIndex::clear(int new_first_id) {
+  first_id = new_first_id;
+  solids.clear();
+  faces.clear();
+  first_face.assign(1, 0);
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+
+// Layout of the indexed .nurbs container (version 300). All values are
+// little-endian, all offsets are absolute file offsets in bytes.
+//
+//   NurbsHeader                       - at offset 0
+//   surface data                      - poles, weights and knots of every
+//                                       face, each array 16-byte aligned
+//   NurbsSolidRecord[solid_count]     - at header.solid_table_offset
+//   NurbsFaceRecord[face_count]       - at header.face_table_offset
+//
+// Faces of a solid are stored contiguously in the face table, so the
+// faces of solid i are [first_face, first_face + face_count).
+// Instances of an already written part (flag solid_instance) reuse the
+// faces of their prototype solid; their transform maps the prototype's
+// coordinates to the instance's ones.
+// Poles are float[4] (x, y, z, 1) in U-major order like in version 200,
+// knots are flat knot sequences. Faces carry no trimming curves: every
+// surface spans its whole knot range, the same untrimmed faces as in
+// <filename>_conv_notrim.brep (--brep_no_trim).
+namespace nurbs_format {
+
+constexpr char magic[] = "VERSION 300";
+constexpr uint32_t version = 300;
+constexpr uint64_t alignment = 16;
+
+struct NurbsHeader
+{
+  char magic[16];               // "VERSION 300", zero padded
+  uint32_t version;
+  uint32_t header_size;
+  uint64_t solid_count;
+  uint64_t face_count;
+  uint64_t solid_table_offset;
+  uint64_t face_table_offset;
+  uint64_t reserved;
+};
+
+enum NurbsSolidFlags : uint32_t
+{
+  solid_failed = 1,             // conversion failed, no faces
+  solid_instance = 2            // faces are the ones of the prototype
+};
+
+struct NurbsSolidRecord
+{
+  uint64_t first_face;
+  uint32_t face_count;
+  uint32_t flags;
+  uint64_t prototype;           // solid id, the solid itself if not an instance
+  uint64_t reserved;
+  double transform[3][4];       // row-major affine transform, identity if not an instance
+};
+
+struct NurbsFaceRecord
+{
+  uint32_t u_degree;
+  uint32_t v_degree;
+  uint32_t nb_u_poles;
+  uint32_t nb_v_poles;
+  uint32_t nb_u_knots;
+  uint32_t nb_v_knots;
+  uint64_t poles_offset;        // float[nb_u_poles*nb_v_poles][4]
+  uint64_t weights_offset;      // float[nb_u_poles*nb_v_poles]
+  uint64_t u_knots_offset;      // float[nb_u_knots]
+  uint64_t v_knots_offset;      // float[nb_v_knots]
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+static_assert(sizeof(NurbsHeader) == 64);
+static_assert(sizeof(NurbsSolidRecord) == 128);
+static_assert(sizeof(NurbsFaceRecord) == 64);
+
+constexpr uint64_t align(uint64_t offset) {
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+} // namespace nurbs_format
@@ -0,0 +1,186 @@
+#pragma once
+
+// Header-only random access reader of .nurbs version 300 files. The file
+// is memory-mapped, surfaces are exposed as spans pointing directly into
+// the mapping, so loading one solid of a huge model touches only the
+// pages of that solid. Depends only on the C++ standard library and POSIX.
+//
+//   nurbs_reader::NurbsFile file("model.nurbs");
+//   auto &transform = file.solid(solid_id).transform;
+//   for (auto face: file.faces(solid_id)) {
+//     auto surface = file.surface(face);
+//     ... surface.poles[i][0..3], surface.weights[i], surface.u_knots ...
+//   }
+//
+// Instances share the faces of their prototype, the solid's transform
+// places them (it is the identity for solids that are not instances).
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nurbs_format.hpp"
+
+namespace nurbs_reader {
+
+template<typename T>
+struct Span
+{
+  const T *ptr = nullptr;
+  size_t count = 0;
+
+  const T *begin() const { return ptr; }
+  const T *end() const { return ptr + count; }
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  const T &operator[](size_t i) const { return ptr[i]; }
+};
+
+using Pole = float[4];
+
+struct Surface
+{
+  uint32_t u_degree, v_degree;
+  uint32_t nb_u_poles, nb_v_poles;
+  Span<Pole> poles;             // nb_u_poles*nb_v_poles, U-major
+  Span<float> weights;
+  Span<float> u_knots, v_knots;
+};
+
+struct FaceRange
+{
+  uint64_t first, last;         // [first, last)
+
+  struct Iterator
+  {
+    uint64_t face;
+    uint64_t operator*() const { return face; }
+    Iterator &operator++() { ++face; return *this; }
+    bool operator!=(const Iterator &other) const { return face != other.face; }
+  };
+  Iterator begin() const { return {first}; }
+  Iterator end() const { return {last}; }
+  uint64_t size() const { return last - first; }
+};
+
+class NurbsFile
+{
+public:
+  explicit NurbsFile(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("can't open " + path);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      ::close(fd);
+      throw std::runtime_error("can't stat " + path);
+    }
+    size_ = static_cast<size_t>(st.st_size);
+    if (size_ < sizeof(nurbs_format::NurbsHeader)) {
+      ::close(fd);
+      throw std::runtime_error(path + " is not a .nurbs version 300 file");
+    }
+    void *data = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+      throw std::runtime_error("can't map " + path);
+    }
+    data_ = static_cast<const char*>(data);
+    try {
+      validate(path);
+    } catch(...) {
+      ::munmap(const_cast<char*>(data_), size_);
+      throw;
+    }
+  }
+
+  NurbsFile(const NurbsFile&) = delete;
+  NurbsFile &operator=(const NurbsFile&) = delete;
+
+  ~NurbsFile() {
+    ::munmap(const_cast<char*>(data_), size_);
+  }
+
+  uint64_t solid_count() const { return header().solid_count; }
+  uint64_t face_count() const { return header().face_count; }
+
+  const nurbs_format::NurbsSolidRecord &solid(uint64_t solid_id) const {
+    return solids_[check(solid_id, solid_count())];
+  }
+
+  bool is_instance(uint64_t solid_id) const {
+    return solid(solid_id).flags & nurbs_format::solid_instance;
+  }
+
+  bool is_failed(uint64_t solid_id) const {
+    return solid(solid_id).flags & nurbs_format::solid_failed;
+  }
+
+  FaceRange faces(uint64_t solid_id) const {
+    auto &record = solid(solid_id);
+    return { record.first_face, record.first_face + record.face_count };
+  }
+
+  const nurbs_format::NurbsFaceRecord &face(uint64_t face_id) const {
+    return faces_[check(face_id, face_count())];
+  }
+
+  Surface surface(uint64_t face_id) const {
+    auto &record = face(face_id);
+    size_t poles = size_t(record.nb_u_poles) * record.nb_v_poles;
+    Surface surface;
+    surface.u_degree = record.u_degree;
+    surface.v_degree = record.v_degree;
+    surface.nb_u_poles = record.nb_u_poles;
+    surface.nb_v_poles = record.nb_v_poles;
+    surface.poles = span<Pole>(record.poles_offset, poles);
+    surface.weights = span<float>(record.weights_offset, poles);
+    surface.u_knots = span<float>(record.u_knots_offset, record.nb_u_knots);
+    surface.v_knots = span<float>(record.v_knots_offset, record.nb_v_knots);
+    return surface;
+  }
+
+private:
+  const nurbs_format::NurbsHeader &header() const {
+    return *reinterpret_cast<const nurbs_format::NurbsHeader*>(data_);
+  }
+
+  static uint64_t check(uint64_t index, uint64_t count) {
+    if (index >= count) {
+      throw std::out_of_range("index out of range in .nurbs file");
+    }
+    return index;
+  }
+
+  template<typename T>
+  Span<T> span(uint64_t offset, size_t count) const {
+    if (offset > size_ || count > (size_ - offset) / sizeof(T)) {
+      throw std::runtime_error("corrupted .nurbs file: section out of bounds");
+    }
+    return { reinterpret_cast<const T*>(data_ + offset), count };
+  }
+
+  void validate(const std::string &path) {
+    auto &h = header();
+    if (std::strncmp(h.magic, nurbs_format::magic, sizeof(nurbs_format::magic)) != 0
+        || h.version != nurbs_format::version
+        || h.header_size != sizeof(nurbs_format::NurbsHeader)) {
+      throw std::runtime_error(path + " is not a .nurbs version 300 file");
+    }
+    solids_ = span<nurbs_format::NurbsSolidRecord>(h.solid_table_offset, h.solid_count).ptr;
+    faces_ = span<nurbs_format::NurbsFaceRecord>(h.face_table_offset, h.face_count).ptr;
+  }
+
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+  const nurbs_format::NurbsSolidRecord *solids_ = nullptr;
+  const nurbs_format::NurbsFaceRecord *faces_ = nullptr;
+};
+
+} // namespace nurbs_reader
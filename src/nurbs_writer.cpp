@@ -0,0 +1,414 @@
+#include <cstring>
+#include <cassert>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "common.hpp"
+
+// Serializer of .nurbs surface records. A version 200 record is
+//   int n, m                          - NbUPoles-1, NbVPoles-1
+//   float poles[(n+1)*(m+1)][4]       - x, y, z, 1
+//   float weights[(n+1)*(m+1)]
+//   int u_degree, v_degree
+//   float u_knots[n+u_degree+2]       - flat knot sequences
+//   float v_knots[m+v_degree+2]
+// Version 300 keeps the same arrays but indexes them (see nurbs_format.hpp).
+// The size of a record is known in advance, so records are written into a
+// preallocated buffer with batched double->float conversion instead of
+// one stream call per value.
+// Periodic surfaces are written as their non-periodic equivalent. The
+// surfaces may be shared by faces, instances and workers, so they are only
+// read: periodic directions are unrolled into thread-local scratch arrays.
+
+namespace {
+
+template<typename T>
+char *put(char *out, const T &value) {
+  std::memcpy(out, &value, sizeof(T));
+  return out + sizeof(T);
+}
+
+char *put_floats(const double *values, size_t count, char *out) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  for (; i+2 <= count; i += 2) {
+    __m128 pair = _mm_cvtpd_ps(_mm_loadu_pd(values+i));
+    _mm_storel_pi(reinterpret_cast<__m64*>(out+i*sizeof(float)), pair);
+  }
+#endif
+  for (; i < count; ++i) {
+    float value = static_cast<float>(values[i]);
+    std::memcpy(out+i*sizeof(float), &value, sizeof(float));
+  }
+  return out + count*sizeof(float);
+}
+
+char *put_poles(const gp_Pnt *poles, size_t count, char *out) {
+  static_assert(sizeof(gp_Pnt) == 3*sizeof(double));
+  const double *coords = reinterpret_cast<const double*>(poles);
+  for (size_t i = 0; i < count; ++i, coords += 3, out += 4*sizeof(float)) {
+#if defined(__SSE2__)
+    __m128 xy = _mm_cvtpd_ps(_mm_loadu_pd(coords));
+    __m128 z1 = _mm_cvtpd_ps(_mm_set_pd(1.0, coords[2]));
+    _mm_storeu_ps(reinterpret_cast<float*>(out), _mm_movelh_ps(xy, z1));
+#else
+    float point_values[4] = {
+      static_cast<float>(coords[0]),
+      static_cast<float>(coords[1]),
+      static_cast<float>(coords[2]),
+      1.0f
+    };
+    std::memcpy(out, point_values, sizeof(point_values));
+#endif
+  }
+  return out;
+}
+
+char *put_weights(const TColStd_Array2OfReal *weights, size_t count, char *out) {
+  if (weights != nullptr) {
+    return put_floats(&weights->First(), count, out);
+  }
+  const float weight = 1.0f;
+  for (size_t i = 0; i < count; ++i) {
+    out = put(out, weight);
+  }
+  return out;
+}
+
+// Pole count of a direction once made non-periodic
+int unperiodic_poles(bool periodic, int degree, const TColStd_Array1OfInteger &mults, int nb_poles) {
+  if (periodic) {
+    int nb_knots;
+    BSplCLib::PrepareUnperiodize(degree, mults, nb_knots, nb_poles);
+  }
+  return nb_poles;
+}
+
+// Record sizes, known without unrolling anything
+struct SurfaceCounts
+{
+  int nb_u_poles, nb_v_poles;
+  int nb_u_knots, nb_v_knots;
+};
+
+SurfaceCounts surface_counts(const Geom_BSplineSurface &bspline) {
+  SurfaceCounts counts;
+  counts.nb_u_poles = unperiodic_poles(
+    bspline.IsUPeriodic(), bspline.UDegree(), bspline.UMultiplicities(), bspline.NbUPoles());
+  counts.nb_v_poles = unperiodic_poles(
+    bspline.IsVPeriodic(), bspline.VDegree(), bspline.VMultiplicities(), bspline.NbVPoles());
+  counts.nb_u_knots = counts.nb_u_poles + bspline.UDegree() + 1;
+  counts.nb_v_knots = counts.nb_v_poles + bspline.VDegree() + 1;
+  return counts;
+}
+
+// Arrays of a surface as SetUNotPeriodic() and SetVNotPeriodic() would
+// leave them: the surface's own arrays, or scratch arrays of the calling
+// thread that stay valid until its next surface_arrays() call.
+struct SurfaceArrays
+{
+  const TColgp_Array2OfPnt *poles;
+  const TColStd_Array2OfReal *weights;    // nullptr if not rational
+  const TColStd_Array1OfReal *u_knots;    // flat knot sequences
+  const TColStd_Array1OfReal *v_knots;
+};
+
+struct UnperiodizeScratch
+{
+  // [0] - U direction, [1] - V direction (applied to the U result)
+  TColStd_Array1OfInteger mults[2];
+  TColStd_Array1OfReal knots[2];
+  TColgp_Array2OfPnt poles[2];
+  TColStd_Array2OfReal weights[2];
+  TColStd_Array1OfReal flat_knots[2];
+};
+
+// Same steps as Geom_BSplineSurface::SetU/VNotPeriodic(), but the result
+// goes to the scratch arrays instead of replacing the surface's ones
+void unperiodize(
+    bool u_direction, int degree,
+    const TColStd_Array1OfInteger &mults, const TColStd_Array1OfReal &knots,
+    SurfaceArrays &arrays) {
+  static thread_local UnperiodizeScratch scratch;
+  int dir = u_direction ? 0 : 1;
+  int nb_knots, nb_poles;
+  BSplCLib::PrepareUnperiodize(degree, mults, nb_knots, nb_poles);
+  int rows = u_direction ? nb_poles : arrays.poles->ColLength();
+  int cols = u_direction ? arrays.poles->RowLength() : nb_poles;
+
+  auto &new_mults = scratch.mults[dir];
+  auto &new_knots = scratch.knots[dir];
+  auto &new_poles = scratch.poles[dir];
+  new_mults.Resize(1, nb_knots, false);
+  new_knots.Resize(1, nb_knots, false);
+  new_poles.Resize(1, rows, 1, cols, false);
+  TColStd_Array2OfReal *new_weights = nullptr;
+  if (arrays.weights != nullptr) {
+    new_weights = &scratch.weights[dir];
+    new_weights->Resize(1, rows, 1, cols, false);
+  }
+  BSplSLib::Unperiodize(
+    u_direction, degree, mults, knots, *arrays.poles, arrays.weights,
+    new_mults, new_knots, new_poles, new_weights);
+
+  auto &flat_knots = scratch.flat_knots[dir];
+  flat_knots.Resize(1, BSplCLib::KnotSequenceLength(new_mults, degree, false), false);
+  BSplCLib::KnotSequence(new_knots, new_mults, degree, false, flat_knots);
+
+  arrays.poles = &new_poles;
+  arrays.weights = new_weights;
+  (u_direction ? arrays.u_knots : arrays.v_knots) = &flat_knots;
+}
+
+SurfaceArrays surface_arrays(const Geom_BSplineSurface &bspline) {
+  SurfaceArrays arrays = {
+    &bspline.Poles(), bspline.Weights(), &bspline.UKnotSequence(), &bspline.VKnotSequence() };
+  if (bspline.IsUPeriodic()) {
+    unperiodize(true, bspline.UDegree(), bspline.UMultiplicities(), bspline.UKnots(), arrays);
+  }
+  if (bspline.IsVPeriodic()) {
+    unperiodize(false, bspline.VDegree(), bspline.VMultiplicities(), bspline.VKnots(), arrays);
+  }
+  return arrays;
+}
+
+} // namespace
+
+size_t nurbs_surface_size(const Geom_BSplineSurface &bspline) {
+  auto counts = surface_counts(bspline);
+  size_t poles = static_cast<size_t>(counts.nb_u_poles) * counts.nb_v_poles;
+  size_t knots = counts.nb_u_knots + counts.nb_v_knots;
+  return 4*sizeof(int) + poles*5*sizeof(float) + knots*sizeof(float);
+}
+
+char *write_nurbs_surface(const Geom_BSplineSurface &bspline, char *out) {
+  auto arrays = surface_arrays(bspline);
+  int n = arrays.poles->ColLength()-1, m = arrays.poles->RowLength()-1;
+  size_t poles = static_cast<size_t>(n+1) * (m+1);
+  out = put(out, n);
+  out = put(out, m);
+
+  out = put_poles(&arrays.poles->First(), poles, out);
+  out = put_weights(arrays.weights, poles, out);
+
+  int u_deg = bspline.UDegree(), v_deg = bspline.VDegree();
+  out = put(out, u_deg);
+  out = put(out, v_deg);
+  out = put_floats(&arrays.u_knots->First(), arrays.u_knots->Length(), out);
+  out = put_floats(&arrays.v_knots->First(), arrays.v_knots->Length(), out);
+  return out;
+}
+
+// Version 200 block of a solid: face count followed by the records
+static void write_nurbs_solid_v2(const std::vector<Handle(Geom_BSplineSurface)> &surfaces, std::string &out) {
+  size_t size = sizeof(int);
+  for (auto &surface: surfaces) {
+    size += nurbs_surface_size(*surface);
+  }
+  size_t offset = out.size();
+  out.resize(offset + size);
+  char *ptr = out.data() + offset;
+  ptr = put(ptr, static_cast<int>(surfaces.size()));
+  for (auto &surface: surfaces) {
+    ptr = write_nurbs_surface(*surface, ptr);
+  }
+  assert(ptr == out.data() + out.size());
+}
+
+// Version 300 block of a solid, as produced by a worker:
+//   uint64_t face_count
+//   NurbsFaceRecord[face_count]    - offsets relative to the data start
+//   data                           - starts at align(8 + 64*face_count)
+// NurbsFileWriter moves the data into the file and rebases the offsets.
+static void write_nurbs_solid_v3(const std::vector<Handle(Geom_BSplineSurface)> &surfaces, std::string &out) {
+  using namespace nurbs_format;
+  std::vector<NurbsFaceRecord> records(surfaces.size());
+  uint64_t data_size = 0;
+  for (size_t i = 0; i < surfaces.size(); ++i) {
+    auto &bspline = *surfaces[i];
+    auto counts = surface_counts(bspline);
+    auto &record = records[i];
+    record = NurbsFaceRecord{};
+    record.u_degree = bspline.UDegree();
+    record.v_degree = bspline.VDegree();
+    record.nb_u_poles = counts.nb_u_poles;
+    record.nb_v_poles = counts.nb_v_poles;
+    record.nb_u_knots = counts.nb_u_knots;
+    record.nb_v_knots = counts.nb_v_knots;
+    uint64_t poles = uint64_t(record.nb_u_poles) * record.nb_v_poles;
+    record.poles_offset = data_size;
+    record.weights_offset = align(record.poles_offset + poles*4*sizeof(float));
+    record.u_knots_offset = align(record.weights_offset + poles*sizeof(float));
+    record.v_knots_offset = align(record.u_knots_offset + record.nb_u_knots*sizeof(float));
+    data_size = align(record.v_knots_offset + record.nb_v_knots*sizeof(float));
+  }
+
+  size_t offset = out.size();
+  uint64_t data_start = align(sizeof(uint64_t) + records.size()*sizeof(NurbsFaceRecord));
+  out.resize(offset + data_start + data_size);
+  char *block = out.data() + offset;
+  char *ptr = put(block, static_cast<uint64_t>(records.size()));
+  std::memcpy(ptr, records.data(), records.size()*sizeof(NurbsFaceRecord));
+
+  char *data = block + data_start;
+  for (size_t i = 0; i < surfaces.size(); ++i) {
+    auto arrays = surface_arrays(*surfaces[i]);
+    auto &record = records[i];
+    uint64_t poles = uint64_t(record.nb_u_poles) * record.nb_v_poles;
+    assert(uint64_t(arrays.poles->Size()) == poles);
+    put_poles(&arrays.poles->First(), poles, data + record.poles_offset);
+    put_weights(arrays.weights, poles, data + record.weights_offset);
+    put_floats(&arrays.u_knots->First(), record.nb_u_knots, data + record.u_knots_offset);
+    put_floats(&arrays.v_knots->First(), record.nb_v_knots, data + record.v_knots_offset);
+  }
+}
+
+// Version 300 block of an instance:
+//   uint64_t instance_block        - marker instead of the face count
+//   uint64_t prototype             - solid id
+//   double transform[3][4]
+static const uint64_t instance_block = ~uint64_t(0);
+
+void write_nurbs_instance(int prototype, const gp_Trsf &transform, std::string &out) {
+  size_t offset = out.size();
+  out.resize(offset + 2*sizeof(uint64_t) + 12*sizeof(double));
+  char *ptr = out.data() + offset;
+  ptr = put(ptr, instance_block);
+  ptr = put(ptr, static_cast<uint64_t>(prototype));
+  for (int row = 1; row <= 3; ++row) {
+    for (int col = 1; col <= 4; ++col) {
+      ptr = put(ptr, transform.Value(row, col));
+    }
+  }
+}
+
+int nurbs_instance_prototype(const std::string &block) {
+  uint64_t marker = 0, prototype = 0;
+  if (block.size() < 2*sizeof(uint64_t)) {
+    return -1;
+  }
+  std::memcpy(&marker, block.data(), sizeof(marker));
+  std::memcpy(&prototype, block.data() + sizeof(marker), sizeof(prototype));
+  return marker == instance_block ? static_cast<int>(prototype) : -1;
+}
+
+void write_nurbs_solid(const std::vector<Handle(Geom_BSplineSurface)> &surfaces, std::string &out, int version) {
+  if (version == 300) {
+    write_nurbs_solid_v3(surfaces, out);
+  } else {
+    write_nurbs_solid_v2(surfaces, out);
+  }
+}
+
+NurbsFileWriter::NurbsFileWriter(const std::filesystem::path &path, int version)
+  : path(path), fout(path, std::ios::binary), version(version) {
+  if (!fout) {
+    throw std::runtime_error("can't open " + path.string() + " for writing");
+  }
+  if (version == 300) {
+    // Placeholder, the header is rewritten with the table offsets on close()
+    nurbs_format::NurbsHeader header{};
+    fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    offset = sizeof(header);
+  } else {
+    fout.write("VERSION 200", 11);
+    offset = 11;
+  }
+}
+
+NurbsFileWriter::~NurbsFileWriter() {
+  if (!fout.is_open()) {
+    return;
+  }
+  if (std::uncaught_exceptions() > exceptions) {
+    // Left by an exception: solids are missing, the file is removed rather
+    // than given a header and tables that would make it look complete
+    fout.close();
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+    return;
+  }
+  close();
+}
+
+void NurbsFileWriter::add_solid(const std::string &block) {
+  if (version != 300) {
+    fout.write(block.data(), block.size());
+    offset += block.size();
+    return;
+  }
+
+  using namespace nurbs_format;
+  NurbsSolidRecord solid{};
+  solid.first_face = faces.size();
+  solid.prototype = solids.size();
+  for (int row = 0; row < 3; ++row) {
+    solid.transform[row][row] = 1.0;
+  }
+  if (block.empty()) {
+    // Failed solid, keeps its slot so solid ids stay valid
+    solid.flags = solid_failed;
+    solids.push_back(solid);
+    return;
+  }
+  uint64_t face_count;
+  std::memcpy(&face_count, block.data(), sizeof(face_count));
+  if (face_count == instance_block) {
+    uint64_t prototype;
+    std::memcpy(&prototype, block.data() + sizeof(uint64_t), sizeof(prototype));
+    assert(prototype < solids.size());
+    auto &prototype_record = solids[prototype];
+    solid.first_face = prototype_record.first_face;
+    solid.face_count = prototype_record.face_count;
+    solid.flags = solid_instance | (prototype_record.flags & solid_failed);
+    solid.prototype = prototype;
+    std::memcpy(solid.transform, block.data() + 2*sizeof(uint64_t), sizeof(solid.transform));
+    solids.push_back(solid);
+    return;
+  }
+  uint64_t data_start = align(sizeof(uint64_t) + face_count*sizeof(NurbsFaceRecord));
+  uint64_t data_offset = align(offset);
+  static const char padding[alignment] = {};
+  fout.write(padding, data_offset - offset);
+  fout.write(block.data() + data_start, block.size() - data_start);
+  offset = data_offset + block.size() - data_start;
+
+  solid.face_count = static_cast<uint32_t>(face_count);
+  solids.push_back(solid);
+  size_t first = faces.size();
+  faces.resize(first + face_count);
+  std::memcpy(faces.data() + first, block.data() + sizeof(uint64_t), face_count*sizeof(NurbsFaceRecord));
+  for (size_t i = first; i < faces.size(); ++i) {
+    faces[i].poles_offset += data_offset;
+    faces[i].weights_offset += data_offset;
+    faces[i].u_knots_offset += data_offset;
+    faces[i].v_knots_offset += data_offset;
+  }
+}
+
+void NurbsFileWriter::close() {
+  if (version == 300) {
+    using namespace nurbs_format;
+    NurbsHeader header{};
+    std::memcpy(header.magic, magic, sizeof(magic));
+    header.version = nurbs_format::version;
+    header.header_size = sizeof(NurbsHeader);
+    header.solid_count = solids.size();
+    header.face_count = faces.size();
+
+    static const char padding[alignment] = {};
+    uint64_t tables_offset = align(offset);
+    fout.write(padding, tables_offset - offset);
+    header.solid_table_offset = tables_offset;
+    fout.write(reinterpret_cast<const char*>(solids.data()), solids.size()*sizeof(NurbsSolidRecord));
+    header.face_table_offset = align(tables_offset + solids.size()*sizeof(NurbsSolidRecord));
+    fout.write(padding, header.face_table_offset - tables_offset - solids.size()*sizeof(NurbsSolidRecord));
+    fout.write(reinterpret_cast<const char*>(faces.data()), faces.size()*sizeof(NurbsFaceRecord));
+
+    fout.seekp(0);
+    fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  }
+  fout.close();
+}
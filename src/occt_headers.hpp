@@ -1,24 +1,46 @@
 #include <STEPControl_Reader.hxx>
+#include <StepFile_ReadData.hxx>
+#include <StepData_StepReaderData.hxx>
+#include <StepData_StepReaderTool.hxx>
+#include <StepData_StepModel.hxx>
+#include <StepData_Protocol.hxx>
+#include <StepData_FileRecognizer.hxx>
+#include <XSControl_WorkSession.hxx>
+#include <XSControl_TransferReader.hxx>
+#include <Transfer_TransientProcess.hxx>
 #include <TopExp_Explorer.hxx>
 #include <TopoDS_Shape.hxx>
 #include <TopoDS_Face.hxx>
 #include <TopoDS_Solid.hxx>
 #include <TopoDS.hxx>
 #include <BRepTools.hxx>
+#include <BinTools.hxx>
+#include <TopoDS_Compound.hxx>
+#include <TopoDS_CompSolid.hxx>
 #include <BRep_Tool.hxx>
 #include <BRepAdaptor_Surface.hxx>
 #include <Geom_BSplineSurface.hxx>
+#include <BSplCLib.hxx>
+#include <BSplSLib.hxx>
 #include <Geom_BezierSurface.hxx>
 #include <BRepBuilderAPI_NurbsConvert.hxx>
+#include <GeomConvert.hxx>
+#include <Geom_RectangularTrimmedSurface.hxx>
 #include <OSD.hxx>
 #include <Message_ProgressIndicator.hxx>
 #include <Message_ProgressRange.hxx>
+#include <Message_ProgressScope.hxx>
 #include <ShapeUpgrade_ShapeDivideClosed.hxx>
 #include <BRep_Builder.hxx>
 #include <BRepMesh_IncrementalMesh.hxx>
+#include <BRepBndLib.hxx>
+#include <Bnd_Box.hxx>
+#include <BRepBuilderAPI_Copy.hxx>
 #include <BRepGProp.hxx>
 #include <GProp_GProps.hxx>
 #include <StlAPI_Writer.hxx>
+#include <Poly_Triangulation.hxx>
 #include <BRepBuilderAPI_Transform.hxx>
 #include <gp_Trsf.hxx>
-#include <BRepBuilderAPI_MakeFace.hxx>
\ No newline at end of file
+#include <BRepBuilderAPI_MakeFace.hxx>
+#include <Precision.hxx>
\ No newline at end of file
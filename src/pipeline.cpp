@@ -0,0 +1,210 @@
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+#include "common.hpp"
+
+void process_solid(
+    int shape_id,
+    const ModelIndex &index,
+    InstanceCache &cache,
+    const PipelineOptions &options,
+    SolidOutput &output) {
+  auto &solid = index.solid(shape_id);
+  if (options.metrics) {
+    output.metrics = SolidMetrics{};
+    // Isolated workers do not share what they compute
+    output.metrics.value().reused = !options.isolate && cache.prototype(shape_id) != shape_id;
+    for (int i = 0; i < index.face_count(shape_id); ++i) {
+      BRepAdaptor_Surface surface(index.face(shape_id, i), false);
+      ++output.metrics.value().face_types[surface.GetType()];
+      if (surface.GetType() == GeomAbs_BSplineSurface || surface.GetType() == GeomAbs_BezierSurface) {
+        output.metrics.value().bspline_poles += uint64_t(surface.NbUPoles()) * surface.NbVPoles();
+      }
+    }
+  }
+  // Converted shapes are not cached, requesting them disables the cache
+  std::string cache_key;
+  if (!options.cache_dir.empty() && !options.conv_shape && !options.conv_shape_notrim) {
+    cache_key = result_key(shape_id, index, cache, options);
+    output.cache_hit = load_result(cache_key, shape_id, index, cache, options, output);
+    if (output.cache_hit.value()) {
+      if (output.metrics) {
+        output.metrics.value().reused = true;
+      }
+      return;
+    }
+  }
+  if (options.stl) {
+    ScopedTimer timer(output.metrics ? &output.metrics.value().mesh : nullptr);
+    std::vector<TopoDS_Shape> lods;
+    if (options.lod_levels > 1) {
+      lods = cache.meshed(solid, [&](const TopoDS_Shape &prototype) {
+        return mesh_solid_lods(
+          prototype, solid_deflection(prototype, options.deflection), options.lod_levels);
+      });
+    } else {
+      cache.mesh(solid, [&]() { mesh_solid(solid, solid_deflection(solid, options.deflection)); });
+      lods.push_back(solid);
+    }
+    if (options.mesh_container) {
+      output.meshes.emplace(lods.size());
+      for (size_t level = 0; level < lods.size(); ++level) {
+        write_mesh_solid(lods[level], output.meshes.value()[level]);
+      }
+    } else {
+      for (size_t level = 0; level < lods.size(); ++level) {
+        auto stl_name = std::to_string(shape_id)
+                      + (level ? "_lod" + std::to_string(level) : std::string()) + ".stl";
+        export_to_stl(lods[level], options.save_dir / stl_name);
+        if (output.metrics) {
+          output.metrics.value().bytes += std::filesystem::file_size(options.save_dir / stl_name);
+        }
+      }
+    }
+  }
+  if (options.nurbs) {
+    output.nurbs = std::string();
+  }
+  if (options.conv_shape) {
+    output.conv_shape = TopoDS_Shape();
+  }
+  if (options.conv_shape_notrim) {
+    output.conv_shape_notrim = TopoDS_Shape();
+  }
+  // The cache keeps the failures for runs with --log_fails
+  if (options.log_fails || !cache_key.empty()) {
+    output.stats = Statistics{};
+  }
+  if (options.nurbs || options.conv_shape || options.conv_shape_notrim) {
+    convert2nurbs(
+      shape_id, index,
+      output.nurbs, output.stats, output.failure, output.failed_faces,
+      output.conv_shape, output.conv_shape_notrim, output.metrics, cache, options);
+  }
+  if (output.metrics) {
+    auto &metrics = output.metrics.value();
+    metrics.bytes += output.nurbs ? output.nurbs.value().size() : 0;
+    if (output.meshes) {
+      for (auto &mesh: output.meshes.value()) {
+        metrics.bytes += mesh.size();
+      }
+    }
+  }
+  if (!cache_key.empty()) {
+    store_result(cache_key, shape_id, options, output);
+    if (!options.log_fails) {
+      output.stats.reset();
+    }
+  }
+}
+
+// Runs process_solid over all solids of the index on options.jobs threads.
+// Workers pick the next unprocessed solid as soon as they are free, so one
+// slow solid does not hold the others back. Finished outputs are handed to emit()
+// on the calling thread strictly in solid_id order.
+void process_solids(
+    const ModelIndex &index,
+    const PipelineOptions &options,
+    const std::function<void(int, SolidOutput&)> &emit_output) {
+  reporter().add_solids(index.size(), index.faces.size());
+  auto emit = [&](int solid_id, SolidOutput &output) {
+    emit_output(solid_id, output);
+    reporter().solid_done(solid_id, index.face_count(solid_id), !output.failure.empty());
+  };
+  if (options.isolate) {
+    process_solids_isolated(index, options, emit);
+    return;
+  }
+  int first_id = index.first_id, shapes_total = index.end_id();
+  InstanceCache cache(index);
+  if (options.jobs <= 1) {
+    for (int solid_id = first_id; solid_id < shapes_total; ++solid_id) {
+      SolidOutput output;
+      process_solid(solid_id, index, cache, options, output);
+      emit(solid_id, output);
+    }
+    return;
+  }
+
+  // Finished but not yet emitted outputs are limited by the window, so a
+  // slow solid can't make the others pile up in memory
+  const int window = 16 * options.jobs;
+  std::mutex mutex;
+  std::condition_variable ready_cv, window_cv;
+  std::deque<std::optional<SolidOutput>> pending; // pending[0] is solid first_pending
+  int first_pending = first_id, next_solid = first_id;
+  std::exception_ptr error;
+
+  auto worker = [&]() {
+    while (true) {
+      int solid_id;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        window_cv.wait(lock, [&]() {
+          return error || next_solid >= shapes_total || next_solid < first_pending + window;
+        });
+        if (error || next_solid >= shapes_total) {
+          return;
+        }
+        solid_id = next_solid++;
+        pending.emplace_back();
+      }
+      SolidOutput output;
+      try {
+        process_solid(solid_id, index, cache, options, output);
+      } catch(...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+        ready_cv.notify_all();
+        window_cv.notify_all();
+        return;
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      pending[solid_id - first_pending] = std::move(output);
+      if (solid_id == first_pending) {
+        ready_cv.notify_one();
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  int jobs = std::min(options.jobs, std::max(index.size(), 1));
+  for (int i = 0; i < jobs; ++i) {
+    workers.emplace_back(worker);
+  }
+
+  for (int solid_id = first_id; solid_id < shapes_total; ++solid_id) {
+    SolidOutput output;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      ready_cv.wait(lock, [&]() {
+        return error || (!pending.empty() && pending.front().has_value());
+      });
+      if (error) {
+        break;
+      }
+      output = std::move(pending.front().value());
+      pending.pop_front();
+      ++first_pending;
+    }
+    window_cv.notify_all();
+    try {
+      emit(solid_id, output);
+    } catch(...) {
+      std::lock_guard<std::mutex> lock(mutex);
+      error = std::current_exception();
+      window_cv.notify_all();
+      break;
+    }
+  }
+
+  for (auto &th: workers) {
+    th.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
@@ -0,0 +1,574 @@
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <iterator>
+
+#include "common.hpp"
+
+// --preflight: what a run would cost, without running it.
+//
+// The STEP file is only tokenized (scan_step), which counts the solids,
+// the faces by the GeomAbs type OCCT gives their surface and the control
+// points of B-spline surfaces. The cost model is linear in these counts:
+//   mesh, convert  CPU seconds per face of every surface type and per pole,
+//                  spread over the jobs;
+//   load           wall seconds per byte of input (read, transfer, index);
+//   peak RSS       base + per byte of input + per face.
+// Calibration fits it to the --metrics files of earlier runs, made with the
+// same options: solid by solid (non-negative least squares) for the CPU
+// times, as a ratio of the totals for the rest. Solids whose work was done
+// for an earlier one (instances, cache hits) are not used. The pole feature
+// is the control points of the B-spline and Bezier surfaces of the file,
+// "bspline_poles" in the metrics: the converted poles of all the faces
+// are not known before the conversion.
+//
+// A file the scan does not support is estimated from its size alone: the
+// features per byte of the calibration runs, planar faces uncalibrated.
+
+namespace {
+
+// Faces of every GeomAbs type, then poles
+constexpr size_t feature_count = geom_abs2str.size() + 1;
+using Features = std::array<double, feature_count>;
+
+// Uncalibrated costs, only good enough to rank models against each other
+constexpr Features default_mesh_cpu = {
+  2e-4, 5e-4, 5e-4, 1e-3, 1.5e-3, 2e-3, 3e-3, 2e-3, 1.5e-3, 4e-3, 3e-3, 5e-6 };
+constexpr Features default_convert_cpu = {
+  3e-4, 8e-4, 8e-4, 1.2e-3, 1.5e-3, 1e-3, 1e-3, 3e-3, 2e-3, 5e-3, 4e-3, 2e-6 };
+constexpr double default_load_per_byte = 4e-8;
+constexpr double default_bytes_per_face = 2048;
+constexpr double memory_base = 64 << 20;
+constexpr double memory_per_byte = 8;
+constexpr double memory_per_face = 16 << 10;
+
+// Just enough JSON for the --metrics files
+struct Json
+{
+  enum Kind { null, boolean, number, string, array, object };
+  Kind kind = null;
+  double value = 0;
+  std::string text;
+  std::vector<Json> items;
+  std::map<std::string, Json> fields;
+
+  // Field of an object, null if absent
+  const Json &operator[](const std::string &key) const {
+    static const Json none;
+    auto found = fields.find(key);
+    return found != fields.end() ? found->second : none;
+  }
+};
+
+class JsonParser
+{
+public:
+  explicit JsonParser(const std::string &text) : text(text) {}
+
+  Json parse() {
+    Json value = parse_value();
+    skip();
+    if (pos != text.size()) {
+      fail("trailing characters");
+    }
+    return value;
+  }
+
+private:
+  [[noreturn]] void fail(const std::string &message) const {
+    throw std::runtime_error(message + " at byte " + std::to_string(pos));
+  }
+
+  void skip() {
+    while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos]))) {
+      ++pos;
+    }
+  }
+
+  // Next non-blank character, consumed if it is c
+  bool next(char c) {
+    skip();
+    if (pos < text.size() && text[pos] == c) {
+      ++pos;
+      return true;
+    }
+    return false;
+  }
+
+  void expect(char c) {
+    if (!next(c)) {
+      fail(std::string("'") + c + "' expected");
+    }
+  }
+
+  bool literal(const char *word) {
+    size_t length = std::strlen(word);
+    if (text.compare(pos, length, word) != 0) {
+      return false;
+    }
+    pos += length;
+    return true;
+  }
+
+  Json parse_value() {
+    skip();
+    Json value;
+    if (next('{')) {
+      value.kind = Json::object;
+      if (next('}')) {
+        return value;
+      }
+      do {
+        skip();
+        auto key = parse_string();
+        expect(':');
+        value.fields[key] = parse_value();
+      } while (next(','));
+      expect('}');
+    } else if (next('[')) {
+      value.kind = Json::array;
+      if (next(']')) {
+        return value;
+      }
+      do {
+        value.items.push_back(parse_value());
+      } while (next(','));
+      expect(']');
+    } else if (pos < text.size() && text[pos] == '"') {
+      value.kind = Json::string;
+      value.text = parse_string();
+    } else if (literal("true")) {
+      value.kind = Json::boolean;
+      value.value = 1;
+    } else if (literal("false")) {
+      value.kind = Json::boolean;
+    } else if (!literal("null")) {
+      const char *start = text.c_str() + pos;
+      char *end;
+      value.kind = Json::number;
+      value.value = std::strtod(start, &end);
+      if (end == start) {
+        fail("value expected");
+      }
+      pos += end - start;
+    }
+    return value;
+  }
+
+  std::string parse_string() {
+    expect('"');
+    std::string result;
+    while (pos < text.size() && text[pos] != '"') {
+      char c = text[pos++];
+      if (c != '\\') {
+        result += c;
+        continue;
+      }
+      if (pos >= text.size()) {
+        break;
+      }
+      c = text[pos++];
+      switch (c) {
+      case 'n': result += '\n'; break;
+      case 't': result += '\t'; break;
+      case 'r': result += '\r'; break;
+      case 'b': result += '\b'; break;
+      case 'f': result += '\f'; break;
+      case 'u': {
+        // Only control characters are escaped this way by json_string()
+        if (pos + 4 > text.size()) {
+          fail("truncated escape");
+        }
+        unsigned code = std::stoul(text.substr(pos, 4), nullptr, 16);
+        result += code < 0x80 ? static_cast<char>(code) : '?';
+        pos += 4;
+        break;
+      }
+      default: result += c;
+      }
+    }
+    if (pos >= text.size()) {
+      fail("unterminated string");
+    }
+    ++pos;
+    return result;
+  }
+
+  const std::string &text;
+  size_t pos = 0;
+};
+
+Json read_json(const std::filesystem::path &path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    throw std::runtime_error("can't open " + path.string());
+  }
+  std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  try {
+    return JsonParser(text).parse();
+  } catch(std::exception &err) {
+    throw std::runtime_error(path.string() + ": " + err.what());
+  }
+}
+
+// Faces by GeomAbs type, from a {"GeomAbs_Plane": 12, ...} object
+Features face_features(const Json &faces, double poles) {
+  Features features{};
+  for (size_t type = 0; type < geom_abs2str.size(); ++type) {
+    features[type] = faces[geom_abs2str[type]].value;
+  }
+  features.back() = poles;
+  return features;
+}
+
+// GeomAbs type of the surface OCCT transfers from a STEP surface entity.
+// Bezier surfaces become B-spline surfaces
+GeomAbs_SurfaceType surface_type(const std::string &type) {
+  static const std::map<std::string, GeomAbs_SurfaceType> simple_types = {
+    { "PLANE", GeomAbs_Plane },
+    { "CYLINDRICAL_SURFACE", GeomAbs_Cylinder },
+    { "CONICAL_SURFACE", GeomAbs_Cone },
+    { "SPHERICAL_SURFACE", GeomAbs_Sphere },
+    { "TOROIDAL_SURFACE", GeomAbs_Torus },
+    { "DEGENERATE_TOROIDAL_SURFACE", GeomAbs_Torus },
+    { "B_SPLINE_SURFACE_WITH_KNOTS", GeomAbs_BSplineSurface },
+    { "BEZIER_SURFACE", GeomAbs_BSplineSurface },
+    { "UNIFORM_SURFACE", GeomAbs_BSplineSurface },
+    { "QUASI_UNIFORM_SURFACE", GeomAbs_BSplineSurface },
+    { "SURFACE_OF_REVOLUTION", GeomAbs_SurfaceOfRevolution },
+    { "SURFACE_OF_LINEAR_EXTRUSION", GeomAbs_SurfaceOfExtrusion },
+    { "OFFSET_SURFACE", GeomAbs_OffsetSurface }
+  };
+  auto found = simple_types.find(type);
+  if (found != simple_types.end()) {
+    return found->second;
+  }
+  // Complex entities, rational ones in particular
+  if (type.find("B_SPLINE_SURFACE") != std::string::npos || type.find("BEZIER_SURFACE") != std::string::npos) {
+    return GeomAbs_BSplineSurface;
+  }
+  return GeomAbs_OtherSurface;
+}
+
+// Non-negative least squares fit of y ~ x.c over the used columns: the
+// columns fitted negative are dropped and the others fitted again
+Features fit(const std::vector<Features> &x, const std::vector<double> &y, std::array<bool, feature_count> used) {
+  while (true) {
+    std::vector<size_t> columns;
+    for (size_t j = 0; j < feature_count; ++j) {
+      if (used[j]) {
+        columns.push_back(j);
+      }
+    }
+    size_t n = columns.size();
+    // Normal equations, slightly regularized so collinear counts stay solvable
+    std::vector<std::vector<double>> a(n, std::vector<double>(n + 1, 0));
+    for (size_t row = 0; row < x.size(); ++row) {
+      for (size_t i = 0; i < n; ++i) {
+        for (size_t k = 0; k < n; ++k) {
+          a[i][k] += x[row][columns[i]] * x[row][columns[k]];
+        }
+        a[i][n] += x[row][columns[i]] * y[row];
+      }
+    }
+    for (size_t i = 0; i < n; ++i) {
+      a[i][i] *= 1 + 1e-6;
+    }
+    // Gauss-Jordan elimination with partial pivoting
+    for (size_t p = 0; p < n; ++p) {
+      size_t pivot = p;
+      for (size_t r = p + 1; r < n; ++r) {
+        if (std::abs(a[r][p]) > std::abs(a[pivot][p])) {
+          pivot = r;
+        }
+      }
+      std::swap(a[p], a[pivot]);
+      if (a[p][p] == 0) {
+        continue;
+      }
+      for (size_t r = 0; r < n; ++r) {
+        if (r != p && a[r][p] != 0) {
+          double factor = a[r][p] / a[p][p];
+          for (size_t k = p; k <= n; ++k) {
+            a[r][k] -= factor * a[p][k];
+          }
+        }
+      }
+    }
+    Features result{};
+    bool negative = false;
+    for (size_t i = 0; i < n; ++i) {
+      result[columns[i]] = a[i][i] != 0 ? a[i][n] / a[i][i] : 0;
+      if (result[columns[i]] < 0) {
+        used[columns[i]] = false;
+        negative = true;
+      }
+    }
+    if (!negative) {
+      return result;
+    }
+  }
+}
+
+struct CostModel
+{
+  Features mesh_cpu = default_mesh_cpu, convert_cpu = default_convert_cpu;
+  double load_per_byte = default_load_per_byte;
+  Features features_per_byte = default_features_per_byte();
+  double memory_scale = 1;      // measured over predicted peak RSS
+  double failed_ratio = 0;      // of the solids
+  size_t runs = 0, solids = 0;  // used for the calibration
+
+  static double memory(double bytes, double faces) {
+    return memory_base + memory_per_byte * bytes + memory_per_face * faces;
+  }
+
+  static Features default_features_per_byte() {
+    Features features{};
+    features[GeomAbs_Plane] = 1 / default_bytes_per_face;
+    return features;
+  }
+};
+
+std::vector<std::filesystem::path> calibration_files(const std::filesystem::path &calibration) {
+  if (!std::filesystem::is_directory(calibration)) {
+    return { calibration };
+  }
+  std::vector<std::filesystem::path> files;
+  for (auto &entry: std::filesystem::recursive_directory_iterator(calibration)) {
+    if (entry.is_regular_file() && entry.path().extension() == ".json") {
+      files.push_back(entry.path());
+    }
+  }
+  std::sort(files.begin(), files.end());
+  return files;
+}
+
+CostModel calibrate(const std::filesystem::path &calibration) {
+  CostModel model;
+  if (calibration.empty()) {
+    return model;
+  }
+  std::vector<Features> x;
+  std::vector<double> mesh_y, convert_y;
+  double load_wall = 0, load_bytes = 0, peak = 0, predicted_peak = 0, failed = 0, solids = 0;
+  Features features{};
+  double feature_bytes = 0, feature_faces = 0;
+  bool directory = std::filesystem::is_directory(calibration);
+  for (auto &path: calibration_files(calibration)) {
+    Json run;
+    try {
+      run = read_json(path);
+    } catch(std::exception &err) {
+      if (!directory) {
+        throw;
+      }
+      reporter().message("Preflight: skipping " + std::string(err.what()));
+      continue;
+    }
+    // Other JSON files of the directory, preflight estimates among them
+    if (run["solids"].kind != Json::array || run["stages"].kind != Json::array) {
+      if (!directory) {
+        throw std::runtime_error(path.string() + " is not a --metrics file");
+      }
+      continue;
+    }
+    ++model.runs;
+    double run_bytes = 0, run_wall = 0, run_peak = run["peak_rss"].value, run_faces = 0;
+    Features run_features{};
+    for (auto &stage: run["stages"].items) {
+      auto &name = stage["name"].text;
+      auto &time = stage["time"];
+      if (name == "read") {
+        run_bytes = stage["bytes"].value;
+      }
+      if (name != "process" && name != "write") {
+        run_wall += time["wall_s"].value;
+      }
+    }
+    for (auto &solid: run["solids"].items) {
+      if (solid["reused"].value) {
+        continue;
+      }
+      x.push_back(face_features(solid["faces"], solid["bspline_poles"].value));
+      mesh_y.push_back(solid["mesh"]["cpu_s"].value);
+      convert_y.push_back(solid["convert"]["cpu_s"].value);
+      for (size_t j = 0; j < feature_count; ++j) {
+        run_features[j] += x.back()[j];
+      }
+      for (size_t type = 0; type < geom_abs2str.size(); ++type) {
+        run_faces += x.back()[type];
+      }
+    }
+    if (run_bytes > 0) {
+      load_wall += run_wall;
+      load_bytes += run_bytes;
+      for (size_t j = 0; j < feature_count; ++j) {
+        features[j] += run_features[j];
+      }
+      feature_bytes += run_bytes;
+      feature_faces += run_faces;
+    }
+    if (run_peak > 0) {
+      peak += run_peak;
+      predicted_peak += CostModel::memory(run_bytes, run_faces);
+    }
+    failed += run["failed_solids"].value;
+    solids += run["solid_count"].value;
+  }
+  if (!model.runs) {
+    throw std::runtime_error("no --metrics files in " + calibration.string());
+  }
+
+  // Types never met keep their default costs
+  std::array<bool, feature_count> seen{};
+  for (auto &row: x) {
+    for (size_t j = 0; j < feature_count; ++j) {
+      seen[j] = seen[j] || row[j] > 0;
+    }
+  }
+  auto mesh_cpu = fit(x, mesh_y, seen);
+  auto convert_cpu = fit(x, convert_y, seen);
+  for (size_t j = 0; j < feature_count; ++j) {
+    if (seen[j]) {
+      model.mesh_cpu[j] = mesh_cpu[j];
+      model.convert_cpu[j] = convert_cpu[j];
+    }
+  }
+  if (load_bytes > 0 && load_wall > 0) {
+    model.load_per_byte = load_wall / load_bytes;
+  }
+  if (feature_bytes > 0 && feature_faces > 0) {
+    for (size_t j = 0; j < feature_count; ++j) {
+      model.features_per_byte[j] = features[j] / feature_bytes;
+    }
+  }
+  if (predicted_peak > 0) {
+    model.memory_scale = peak / predicted_peak;
+  }
+  model.failed_ratio = solids > 0 ? failed / solids : 0;
+  model.solids = x.size();
+  return model;
+}
+
+double dot(const Features &costs, const Features &counts) {
+  double total = 0;
+  for (size_t j = 0; j < feature_count; ++j) {
+    total += costs[j] * counts[j];
+  }
+  return total;
+}
+
+uint64_t count_of(const StepScan &scan, const std::string &type) {
+  auto found = scan.types.find(type);
+  return found != scan.types.end() ? found->second : 0;
+}
+
+} // namespace
+
+void preflight(
+    const std::filesystem::path &file_path,
+    const std::filesystem::path &calibration,
+    const PipelineOptions &options) {
+  if (file_path.extension() != ".step" && file_path.extension() != ".stp") {
+    throw std::invalid_argument("--preflight needs a .step or .stp file");
+  }
+  auto model = calibrate(calibration);
+
+  double bytes = std::filesystem::file_size(file_path);
+  StepScan scan;
+  StageTime scan_time;
+  std::string scan_error;
+  {
+    ProgressStage stage("Scanning STEP file");
+    ScopedTimer timer(&scan_time);
+    try {
+      scan = scan_step(file_path, options.jobs);
+    } catch(std::exception &err) {
+      scan_error = err.what();
+      reporter().message("Preflight: " + scan_error + ", estimating from the file size only");
+    }
+  }
+  bool size_only = !scan_error.empty();
+  Features counts{};
+  uint64_t faces = 0;
+  if (size_only) {
+    for (size_t j = 0; j < feature_count; ++j) {
+      counts[j] = std::round(model.features_per_byte[j] * bytes);
+    }
+    for (size_t type = 0; type < geom_abs2str.size(); ++type) {
+      faces += counts[type];
+    }
+  } else {
+    for (auto &[type, count]: scan.face_surfaces) {
+      counts[surface_type(type)] += count;
+      faces += count;
+    }
+    counts.back() = scan.poles;
+  }
+  uint64_t solids = count_of(scan, "MANIFOLD_SOLID_BREP") + count_of(scan, "BREP_WITH_VOIDS");
+
+  double load = model.load_per_byte * bytes;
+  double mesh_cpu = options.stl ? dot(model.mesh_cpu, counts) : 0;
+  bool convert = options.nurbs || options.conv_shape || options.conv_shape_notrim;
+  double convert_cpu = convert ? dot(model.convert_cpu, counts) : 0;
+  double wall = load + (mesh_cpu + convert_cpu) / std::max(options.jobs, 1);
+  double peak = model.memory_scale * CostModel::memory(bytes, faces);
+
+  std::filesystem::create_directories(options.save_dir);
+  auto path = options.save_dir / (file_path.filename().string() + "_preflight.json");
+  std::ofstream out(path);
+  if (!out) {
+    throw std::runtime_error("can't open " + path.string() + " for writing");
+  }
+  out << std::setprecision(6)
+      << "{\n  \"file\": " << json_string(file_path.string()) << ",\n"
+      << "  \"bytes\": " << static_cast<uint64_t>(bytes) << ",\n"
+      << "  \"scan_s\": " << scan_time.wall << ",\n"
+      << "  \"size_only\": " << (size_only ? "true" : "false") << ",\n"
+      << "  \"scan_error\": " << (size_only ? json_string(scan_error) : "null") << ",\n";
+  // Unknown without the scan
+  auto scanned = [&](uint64_t count) { return size_only ? std::string("null") : std::to_string(count); };
+  out << "  \"entities\": " << scanned(scan.entities) << ",\n"
+      << "  \"solids\": " << scanned(solids) << ",\n"
+      << "  \"assembly_usages\": " << scanned(count_of(scan, "NEXT_ASSEMBLY_USAGE_OCCURRENCE")) << ",\n"
+      << "  \"faces\": " << faces << ",\n"
+      << "  \"face_types\": {";
+  bool first = true;
+  for (size_t type = 0; type < geom_abs2str.size(); ++type) {
+    if (counts[type]) {
+      out << (first ? "" : ", ") << json_string(geom_abs2str[type]) << ": " << counts[type];
+      first = false;
+    }
+  }
+  out << "},\n"
+      << "  \"poles\": " << static_cast<uint64_t>(counts.back()) << ",\n"
+      << "  \"calibration\": ";
+  if (model.runs) {
+    out << "{\"runs\": " << model.runs << ", \"solids\": " << model.solids << "}";
+  } else {
+    out << "null";
+  }
+  out << ",\n  \"estimate\": {\"load_s\": " << load
+      << ", \"mesh_cpu_s\": " << mesh_cpu
+      << ", \"convert_cpu_s\": " << convert_cpu
+      << ", \"wall_s\": " << wall
+      << ", \"peak_rss\": " << static_cast<uint64_t>(peak)
+      << ", \"failed_solids\": " << scanned(std::llround(model.failed_ratio * solids)) << "}\n}\n";
+  if (!out) {
+    throw std::runtime_error("can't write " + path.string());
+  }
+
+  std::ostringstream summary;
+  summary << std::fixed << std::setprecision(1) << "Preflight: ";
+  if (size_only) {
+    summary << "about " << faces << " faces from the file size, estimated ";
+  } else {
+    summary << solids << " solids, " << faces << " faces, estimated ";
+  }
+  summary << wall << " s and " << (peak / (1 << 20)) << " MB peak"
+          << (model.runs ? "" : " (uncalibrated)");
+  reporter().message(summary.str());
+}
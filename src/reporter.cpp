@@ -0,0 +1,274 @@
+#include <iostream>
+#include <iomanip>
+
+#include <unistd.h>
+
+#include "common.hpp"
+
+// A redirected tty status is printed as lines, this many times less often
+constexpr int redirected_refresh_ratio = 10;
+
+Reporter &reporter() {
+  static Reporter instance;
+  return instance;
+}
+
+Reporter::~Reporter() {
+  stop();
+}
+
+void Reporter::start(ProgressMode mode) {
+  this->mode = mode;
+  terminal = isatty(STDOUT_FILENO);
+  started = std::chrono::steady_clock::now();
+  stopping = false;
+  running = true;
+  thread = std::thread(&Reporter::run, this);
+}
+
+void Reporter::stop() {
+  if (!thread.joinable()) {
+    return;
+  }
+  // Later events are written directly, the queue is drained once more
+  running = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wakeup.notify_one();
+  thread.join();
+}
+
+void Reporter::detach() {
+  detached = true;
+}
+
+void Reporter::push(ProgressEvent &event) {
+  if (!running || detached) {
+    // Nobody drains the queue, so only what must not be lost is written
+    if (event.kind == ProgressEvent::error) {
+      std::cerr << (event.solid_id >= 0 ? std::to_string(event.solid_id) + ": " : std::string())
+                << event.text << std::endl;
+    } else if (event.kind == ProgressEvent::message && mode != ProgressMode::quiet) {
+      std::cout << event.text << std::endl;
+    }
+    return;
+  }
+  while (!queue.try_push(event)) {
+    // Full, the reporter drains it now rather than on its next tick
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      drain = true;
+    }
+    wakeup.notify_one();
+    std::this_thread::yield();
+  }
+}
+
+ProgressCounters &Reporter::counters() {
+  thread_local size_t slot = next_slot++ % counter_slots;
+  return slots[slot];
+}
+
+void Reporter::message(std::string text) {
+  ProgressEvent event;
+  event.kind = ProgressEvent::message;
+  event.text = std::move(text);
+  push(event);
+}
+
+void Reporter::error(int solid_id, std::string text) {
+  ProgressEvent event;
+  event.kind = ProgressEvent::error;
+  event.solid_id = solid_id;
+  event.text = std::move(text);
+  push(event);
+}
+
+void Reporter::add_solids(uint64_t solids, uint64_t faces) {
+  auto &local = counters();
+  local.solids_total.fetch_add(solids, std::memory_order_relaxed);
+  local.faces_total.fetch_add(faces, std::memory_order_relaxed);
+}
+
+void Reporter::solid_done(int, uint64_t faces, bool failed) {
+  auto &local = counters();
+  local.solids_done.fetch_add(1, std::memory_order_relaxed);
+  local.faces_done.fetch_add(faces, std::memory_order_relaxed);
+  local.failed_solids.fetch_add(failed, std::memory_order_relaxed);
+}
+
+void Reporter::face_done(bool failed) {
+  auto &local = counters();
+  local.faces_converted.fetch_add(1, std::memory_order_relaxed);
+  local.failed_faces.fetch_add(failed, std::memory_order_relaxed);
+}
+
+void Reporter::begin_stage(const std::string &name, const Message_ProgressIndicator *indicator) {
+  if (indicator) {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->indicator = indicator;
+  }
+  ProgressEvent event;
+  event.kind = ProgressEvent::stage;
+  event.text = name;
+  push(event);
+}
+
+void Reporter::end_stage(const Message_ProgressIndicator *indicator) {
+  // The indicator is about to be destroyed, it must not be polled anymore
+  std::lock_guard<std::mutex> lock(mutex);
+  if (indicator && this->indicator == indicator) {
+    this->indicator = nullptr;
+  }
+}
+
+void Reporter::run() {
+  auto period = std::chrono::milliseconds(1000 / refresh_rate);
+  auto next_tick = std::chrono::steady_clock::now() + period;
+  int tick = 0;
+  while (true) {
+    bool last;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wakeup.wait_until(lock, next_tick, [&]() { return stopping || drain; });
+      last = stopping;
+      drain = false;
+    }
+    ProgressEvent event;
+    while (queue.try_pop(event)) {
+      apply(event);
+    }
+    if (last) {
+      draw(true);
+      return;
+    }
+    // Woken up early to drain a full queue
+    if (std::chrono::steady_clock::now() < next_tick) {
+      continue;
+    }
+    next_tick = std::chrono::steady_clock::now() + period;
+    // Lines of a redirected status are not overwritten, so they are rarer
+    if (mode == ProgressMode::json || terminal || ++tick % redirected_refresh_ratio == 0) {
+      draw(false);
+    }
+  }
+}
+
+void Reporter::apply(ProgressEvent &event) {
+  switch (event.kind) {
+  case ProgressEvent::message:
+    if (mode == ProgressMode::json) {
+      print("{\"event\": \"message\", \"text\": " + json_string(event.text) + "}", false);
+    } else if (mode == ProgressMode::tty) {
+      print(event.text, false);
+    }
+    break;
+  case ProgressEvent::error:
+    if (mode == ProgressMode::json) {
+      print("{\"event\": \"error\", \"solid\": " + std::to_string(event.solid_id)
+            + ", \"text\": " + json_string(event.text) + "}", false);
+    } else {
+      print((event.solid_id >= 0 ? std::to_string(event.solid_id) + ": " : std::string()) + event.text, true);
+    }
+    break;
+  case ProgressEvent::stage:
+    stage = event.text;
+    if (mode == ProgressMode::json) {
+      print("{\"event\": \"stage\", \"name\": " + json_string(stage) + "}", false);
+    }
+    break;
+  }
+}
+
+// Writes a line, taking the tty status line out of the way
+void Reporter::print(const std::string &line, bool to_stderr) {
+  if (mode == ProgressMode::tty && terminal && status_width) {
+    std::cout << '\r' << std::string(status_width, ' ') << '\r' << std::flush;
+    status_width = 0;
+    last_status.clear();
+  }
+  (to_stderr ? std::cerr : std::cout) << line << '\n';
+  (to_stderr ? std::cerr : std::cout) << std::flush;
+}
+
+void Reporter::draw(bool final) {
+  if (mode == ProgressMode::quiet) {
+    return;
+  }
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+  double position = -1;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (indicator) {
+      position = indicator->GetPosition();
+    }
+  }
+  uint64_t solids_total = 0, solids_done = 0, failed_solids = 0;
+  uint64_t faces_total = 0, faces_done = 0, faces_converted = 0, failed_faces = 0;
+  for (auto &slot: slots) {
+    solids_total += slot.solids_total.load(std::memory_order_relaxed);
+    solids_done += slot.solids_done.load(std::memory_order_relaxed);
+    failed_solids += slot.failed_solids.load(std::memory_order_relaxed);
+    faces_total += slot.faces_total.load(std::memory_order_relaxed);
+    faces_done += slot.faces_done.load(std::memory_order_relaxed);
+    faces_converted += slot.faces_converted.load(std::memory_order_relaxed);
+    failed_faces += slot.failed_faces.load(std::memory_order_relaxed);
+  }
+
+  std::ostringstream status;
+  status << std::fixed << std::setprecision(0);
+  if (mode == ProgressMode::json) {
+    status << "{\"event\": \"" << (final ? "done" : "progress") << "\""
+           << ", \"stage\": " << json_string(stage)
+           << ", \"solids_done\": " << solids_done << ", \"solids_total\": " << solids_total
+           << ", \"failed_solids\": " << failed_solids
+           << ", \"faces_done\": " << faces_done << ", \"faces_total\": " << faces_total
+           << ", \"faces_converted\": " << faces_converted << ", \"failed_faces\": " << failed_faces;
+    if (position >= 0) {
+      status << ", \"position\": " << std::setprecision(3) << position;
+    }
+    status << ", \"wall_s\": " << std::setprecision(1) << elapsed << "}";
+  } else {
+    status << stage;
+    if (position >= 0) {
+      status << " " << position*100 << "%";
+    }
+    if (solids_total) {
+      status << " | solids " << solids_done << "/" << solids_total;
+      if (failed_solids) {
+        status << " (" << failed_solids << " failed)";
+      }
+      status << " | faces " << faces_done << "/" << faces_total;
+      if (failed_faces) {
+        status << " (" << failed_faces << " failed)";
+      }
+      if (elapsed > 0) {
+        status << " | " << faces_done / elapsed << " faces/s";
+      }
+    }
+  }
+  std::string line = status.str();
+  // Elapsed time alone does not make a new JSON progress line
+  std::string key = mode == ProgressMode::json ? line.substr(0, line.rfind(", \"wall_s\"")) : line;
+  if (line.empty() || (!final && key == last_status)) {
+    return;
+  }
+  last_status = key;
+
+  if (mode == ProgressMode::tty && terminal) {
+    std::cout << '\r' << line;
+    if (line.size() < status_width) {
+      std::cout << std::string(status_width - line.size(), ' ');
+    }
+    status_width = line.size();
+    if (final) {
+      std::cout << '\n';
+      status_width = 0;
+    }
+    std::cout << std::flush;
+  } else if (!line.empty()) {
+    std::cout << line << '\n' << std::flush;
+  }
+}
@@ -0,0 +1,271 @@
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "common.hpp"
+#include "byte_buffer.hpp"
+
+// Result cache (--cache_dir). An entry holds everything a solid adds to
+// the outputs: its .nurbs block, its .mesh blocks or .stl files and the
+// conversion failures of the solid and of its faces. Entries are keyed on the content hash of the
+// solid's prototype (BinTools dump of the unlocated shape), the solid's
+// placement and the options the outputs depend on, so a re-run of a
+// revised model only recomputes the solids that changed. Converted
+// .brep outputs are not cached.
+//
+// Entry file <cache_dir>/<key[0..1]>/<key>:
+//   string magic
+//   string failure
+//   uint32_t failed_faces
+//   uint64_t fails, string fail[fails]   (without the "<solid_id>: " prefix)
+//   uint8_t has_nurbs, [string nurbs]
+//   uint64_t meshes, string mesh[meshes]
+//   uint64_t stl_files, string stl[stl_files]
+
+using namespace byte_buffer;
+
+namespace {
+
+// Bumped whenever the entry layout or the meaning of cached outputs changes
+const std::string cache_magic = "OCCT-STEP-Reader cache 3";
+
+uint64_t rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+uint64_t fmix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+std::filesystem::path entry_path(const std::filesystem::path &cache_dir, const std::string &key) {
+  return cache_dir / key.substr(0, 2) / key;
+}
+
+bool read_file(const std::filesystem::path &path, std::string &data) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    return false;
+  }
+  std::ostringstream buf;
+  buf << in.rdbuf();
+  data = buf.str();
+  return true;
+}
+
+std::vector<std::filesystem::path> stl_paths(int solid_id, const PipelineOptions &options) {
+  std::vector<std::filesystem::path> paths;
+  for (int level = 0; level < options.lod_levels; ++level) {
+    auto stl_name = std::to_string(solid_id)
+                  + (level ? "_lod" + std::to_string(level) : std::string()) + ".stl";
+    paths.push_back(options.save_dir / stl_name);
+  }
+  return paths;
+}
+
+} // namespace
+
+// 128-bit non-cryptographic hash (two 64-bit lanes), hex encoded
+std::string content_hash(const std::string &data) {
+  const uint64_t c1 = 0x87c37b91114253d5ull, c2 = 0x4cf5ad432745937full;
+  uint64_t h1 = 0x9E3779B97F4A7C15ull ^ data.size(), h2 = 0xC2B2AE3D27D4EB4Full + data.size();
+  auto step = [&](uint64_t w) {
+    h1 = rotl(h1 ^ (w * c1), 31) * c2;
+    h2 = (rotl(h2 + (w * c2), 27) * c1) ^ h1;
+  };
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= data.size(); i += sizeof(uint64_t)) {
+    uint64_t w;
+    std::memcpy(&w, data.data() + i, sizeof(w));
+    step(w);
+  }
+  if (i < data.size()) {
+    uint64_t w = 0;
+    std::memcpy(&w, data.data() + i, data.size() - i);
+    step(w);
+  }
+  h1 = fmix(h1 ^ h2);
+  h2 = fmix(h2 + h1);
+  std::ostringstream hex;
+  hex << std::hex << std::setfill('0') << std::setw(16) << h1 << std::setw(16) << h2;
+  return hex.str();
+}
+
+std::string result_key(int solid_id, const ModelIndex &index, InstanceCache &cache, const PipelineOptions &options) {
+  auto &solid = index.solid(solid_id);
+  std::ostringstream key;
+  key << cache_magic << '\n' << cache.shape_hash(solid) << '\n' << int(solid.Orientation()) << '\n';
+  auto transform = solid.Location().Transformation();
+  key << std::hexfloat;
+  for (int row = 1; row <= 3; ++row) {
+    for (int col = 1; col <= 4; ++col) {
+      key << transform.Value(row, col) << ' ';
+    }
+  }
+  // Version 300 instances are written as references to their prototype
+  bool instance = options.nurbs_version == 300 && cache.prototype(solid_id) != solid_id;
+  key << '\n' << options.nurbs << ' ' << options.nurbs_version << ' ' << instance
+      << '\n' << options.stl << ' ' << options.mesh_container << ' '
+      << options.deflection << ' ' << options.lod_levels;
+  return content_hash(key.str());
+}
+
+bool load_result(
+    const std::string &key, int solid_id,
+    const ModelIndex &index, InstanceCache &cache,
+    const PipelineOptions &options, SolidOutput &output) {
+  std::string data;
+  if (!read_file(entry_path(options.cache_dir, key), data)) {
+    return false;
+  }
+  SolidOutput cached;
+  std::vector<std::string> fails, stl_files;
+  try {
+    Cursor cursor{data};
+    if (cursor.get_string() != cache_magic) {
+      return false;
+    }
+    cached.failure = cursor.get_string();
+    cached.failed_faces = cursor.get<uint32_t>();
+    auto fail_count = cursor.get<uint64_t>();
+    for (uint64_t i = 0; i < fail_count; ++i) {
+      fails.push_back(cursor.get_string());
+    }
+    if (cursor.get<uint8_t>()) {
+      cached.nurbs = cursor.get_string();
+    }
+    if (auto meshes = cursor.get<uint64_t>()) {
+      cached.meshes.emplace();
+      for (uint64_t i = 0; i < meshes; ++i) {
+        cached.meshes.value().push_back(cursor.get_string());
+      }
+    }
+    auto stl_count = cursor.get<uint64_t>();
+    for (uint64_t i = 0; i < stl_count; ++i) {
+      stl_files.push_back(cursor.get_string());
+    }
+  } catch(std::exception &err) {
+    // Truncated or corrupted entry, recomputed and overwritten
+    return false;
+  }
+
+  auto paths = stl_paths(solid_id, options);
+  if (options.nurbs != cached.nurbs.has_value()
+      || (options.stl && !options.mesh_container && stl_files.size() != paths.size())) {
+    return false;
+  }
+  if (options.stl && !options.mesh_container) {
+    for (size_t level = 0; level < paths.size(); ++level) {
+      std::ofstream out(paths[level], std::ios::binary);
+      out.write(stl_files[level].data(), stl_files[level].size());
+      if (!out) {
+        // Not a hit, the solid is recomputed and its files written again
+        return false;
+      }
+    }
+  }
+  output.meshes = std::move(cached.meshes);
+  output.failure = cached.failure;
+  output.failed_faces = cached.failed_faces;
+  if (options.nurbs) {
+    output.nurbs = std::move(cached.nurbs.value());
+    bool instance = options.nurbs_version == 300 && cache.prototype(solid_id) != solid_id;
+    if (instance && output.failure.empty()) {
+      // The prototype id and placement are the ones of this run
+      write_nurbs_instance(cache.prototype(solid_id), cache.relative_transform(solid_id), output.nurbs.value());
+    }
+  }
+  if (options.log_fails) {
+    output.stats = Statistics{};
+    for (auto &fail: fails) {
+      output.stats.value().fails.push_back(std::to_string(solid_id)+": "+fail);
+    }
+    if (!fails.empty()) {
+      output.stats.value().failed_solids.push_back({std::to_string(solid_id)+".brep", index.solid(solid_id)});
+    }
+  }
+  if (output.metrics) {
+    auto &metrics = output.metrics.value();
+    metrics.failure = output.failure;
+    metrics.failed_faces = output.failed_faces;
+    for (auto &stl: stl_files) {
+      metrics.bytes += stl.size();
+    }
+    metrics.bytes += output.nurbs ? output.nurbs.value().size() : 0;
+    if (output.meshes) {
+      for (auto &mesh: output.meshes.value()) {
+        metrics.bytes += mesh.size();
+      }
+    }
+  }
+  return true;
+}
+
+void store_result(const std::string &key, int solid_id, const PipelineOptions &options, const SolidOutput &output) {
+  std::string data;
+  put_string(data, cache_magic);
+  put_string(data, output.failure);
+  put(data, output.failed_faces);
+  // Messages are prefixed with the solid id, which may differ on a hit
+  std::string prefix = std::to_string(solid_id) + ": ";
+  auto fails = output.stats ? output.stats.value().fails : std::vector<std::string>();
+  put(data, static_cast<uint64_t>(fails.size()));
+  for (auto &fail: fails) {
+    put_string(data, fail.compare(0, prefix.size(), prefix) == 0 ? fail.substr(prefix.size()) : fail);
+  }
+  uint64_t marker = 0;
+  if (output.nurbs && output.nurbs.value().size() >= sizeof(marker)) {
+    std::memcpy(&marker, output.nurbs.value().data(), sizeof(marker));
+  }
+  bool instance = options.nurbs_version == 300 && output.failure.empty() && marker == ~uint64_t(0);
+  put<uint8_t>(data, output.nurbs.has_value());
+  if (output.nurbs) {
+    // Instance blocks are rebuilt on load, they refer to solid ids
+    put_string(data, instance ? std::string() : output.nurbs.value());
+  }
+  put(data, static_cast<uint64_t>(output.meshes ? output.meshes.value().size() : 0));
+  if (output.meshes) {
+    for (auto &mesh: output.meshes.value()) {
+      put_string(data, mesh);
+    }
+  }
+  std::vector<std::string> stl_files;
+  if (options.stl && !options.mesh_container) {
+    for (auto &path: stl_paths(solid_id, options)) {
+      if (!read_file(path, stl_files.emplace_back())) {
+        return;
+      }
+    }
+  }
+  put(data, static_cast<uint64_t>(stl_files.size()));
+  for (auto &stl: stl_files) {
+    put_string(data, stl);
+  }
+
+  // Written under a unique name and renamed, so concurrent runs and
+  // workers never see a partial entry
+  auto path = entry_path(options.cache_dir, key);
+  std::filesystem::create_directories(path.parent_path());
+  auto tmp_path = path;
+  tmp_path += ".tmp" + std::to_string(getpid()) + "_"
+            + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+  {
+    std::ofstream out(tmp_path, std::ios::binary);
+    out.write(data.data(), data.size());
+    if (!out) {
+      reporter().error(solid_id, "can't write cache entry " + tmp_path.string());
+      return;
+    }
+  }
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, path, ec);
+  if (ec) {
+    std::filesystem::remove(tmp_path, ec);
+  }
+}
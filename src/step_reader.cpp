@@ -0,0 +1,727 @@
+#include <cstring>
+#include <charconv>
+#include <exception>
+#include <string_view>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.hpp"
+
+// Parallel front-end of STEPControl_Reader::ReadFile.
+//
+// The stock reader lexes and parses the whole file on a single thread
+// (flex and bison recording into a StepFile_ReadData), copies the records
+// into a StepData_StepReaderData, then StepData_StepReaderTool creates
+// and loads the entities of the model. Here the file is memory-mapped,
+// its DATA section is split into chunks at entity boundaries and every
+// chunk is tokenized on its own thread into its own StepFile_ReadData,
+// through the calls the stock grammar makes for the same input. Sub-lists,
+// typed parameters and complex entities are so recorded exactly like the
+// stock parser does. The chunks are then copied in file order into a
+// single StepData_StepReaderData, loaded by the stock tool.
+//
+// A chunk starts after a ';' followed by a line break and "#<id> =".
+// Strings spanning lines are not supported, but a comment may look the
+// same, so a boundary is only trusted if the chunk before it parses up to
+// it exactly: the first chunk starts at a real boundary, hence by
+// induction all of them do. Anything the
+// tokenizer does not support (scopes, strings spanning lines, several
+// DATA sections, syntax errors, ...) sends the file to the stock reader.
+//
+// scan_step() runs the same tokenizer into counters instead of records,
+// for --preflight: entity and face counts without building the model.
+
+namespace {
+
+// Parallel chunks are never smaller than that
+constexpr size_t min_chunk_size = 1 << 20;
+// Chunks per thread, so threads finishing early pick up more work
+constexpr size_t chunks_per_thread = 4;
+
+// Something the fast path does not handle, the stock reader takes over
+class Unsupported : public std::runtime_error
+{
+public:
+  using std::runtime_error::runtime_error;
+};
+
+class MappedFile
+{
+public:
+  explicit MappedFile(const std::filesystem::path &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw Unsupported("can't open " + path.string());
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+      ::close(fd);
+      throw Unsupported("empty file");
+    }
+    size = st.st_size;
+    void *ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (ptr == MAP_FAILED) {
+      throw Unsupported(std::string("mmap failed: ") + std::strerror(errno));
+    }
+    madvise(ptr, size, MADV_WILLNEED);
+    data = static_cast<const char*>(ptr);
+  }
+  ~MappedFile() {
+    munmap(const_cast<char*>(data), size);
+  }
+  MappedFile(const MappedFile&) = delete;
+  MappedFile &operator=(const MappedFile&) = delete;
+  const char *begin() const { return data; }
+  const char *end() const { return data + size; }
+private:
+  const char *data = nullptr;
+  size_t size = 0;
+};
+
+bool is_digit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+bool is_upper(char c) {
+  return c >= 'A' && c <= 'Z';
+}
+
+bool is_keyword_char(char c) {
+  return is_digit(c) || is_upper(c) || (c >= 'a' && c <= 'z') || c == '_';
+}
+
+bool is_space(char c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+// Tokenizes [pos, end) into data, with the calls the lexer and the
+// grammar of the stock parser make on the same tokens. Data is a
+// StepFile_ReadData, or an EntityCounter for scan_step()
+template<typename Data>
+class ChunkParser
+{
+public:
+  ChunkParser(const char *file, const char *begin, const char *end, Data &data)
+    : file(file), pos(begin), end(end), data(data) {}
+
+  // From the start of the file to the DATA keyword included, returns the
+  // position following it
+  const char *header() {
+    skip();
+    if (!keyword("ISO-10303-21") || (skip(), !keyword("HEADER"))) {
+      fail("ISO-10303-21 header expected");
+    }
+    while (skip(), !keyword("ENDSEC")) {
+      type();
+      data.RecordType();
+      list();
+      skip();
+      expect(';');
+    }
+    skip();
+    if (!keyword("DATA")) {
+      fail("a single DATA section expected");
+    }
+    data.FinalOfHead();
+    return pos;
+  }
+
+  // Entity instances up to the end of the chunk
+  void entities() {
+    skip();
+    while (pos < end) {
+      entity();
+      skip();
+    }
+  }
+
+private:
+  [[noreturn]] void fail(const std::string &message) const {
+    throw Unsupported(message + " at byte " + std::to_string(pos - file));
+  }
+
+  // Whitespace and comments
+  void skip() {
+    while (pos < end) {
+      if (is_space(*pos)) {
+        ++pos;
+      } else if (*pos == '/' && pos + 1 < end && pos[1] == '*') {
+        auto close = static_cast<const char*>(memmem(pos + 2, end - pos - 2, "*/", 2));
+        if (!close) {
+          fail("unterminated comment");
+        }
+        pos = close + 2;
+      } else {
+        return;
+      }
+    }
+  }
+
+  void expect(char c) {
+    if (pos >= end || *pos != c) {
+      fail(std::string("'") + c + "' expected");
+    }
+    ++pos;
+  }
+
+  // keyword followed by ';', consumed if found
+  bool keyword(const char *word) {
+    size_t length = std::strlen(word);
+    if (static_cast<size_t>(end - pos) < length || std::memcmp(pos, word, length) != 0) {
+      return false;
+    }
+    const char *start = pos;
+    pos += length;
+    skip();
+    if (pos < end && *pos == ';') {
+      ++pos;
+      return true;
+    }
+    pos = start;
+    return false;
+  }
+
+  void text(const char *start, Interface_ParamType type) {
+    data.CreateNewText(start, static_cast<int>(pos - start));
+    data.SetTypeArg(type);
+  }
+
+  // Entity type name, user-defined ones start with '!'
+  void type() {
+    const char *start = pos;
+    if (pos < end && *pos == '!') {
+      ++pos;
+    }
+    while (pos < end && is_keyword_char(*pos)) {
+      ++pos;
+    }
+    if (pos == start || is_digit(*start)) {
+      fail("entity type expected");
+    }
+    data.CreateNewText(start, static_cast<int>(pos - start));
+  }
+
+  // #<id> = TYPE(...); or #<id> = (TYPE(...) TYPE(...) ...);
+  void entity() {
+    const char *start = pos;
+    expect('#');
+    while (pos < end && is_digit(*pos)) {
+      ++pos;
+    }
+    if (pos - start < 2) {
+      fail("entity instance name expected");
+    }
+    data.CreateNewText(start, static_cast<int>(pos - start));
+    data.RecordIdent();
+    skip();
+    expect('=');
+    skip();
+    if (pos < end && *pos == '(') {
+      // Complex entity, a record per partial type
+      ++pos;
+      skip();
+      do {
+        type();
+        data.RecordType();
+        list();
+        skip();
+      } while (pos < end && *pos != ')');
+      expect(')');
+    } else {
+      type();
+      data.RecordType();
+      list();
+    }
+    skip();
+    expect(';');
+  }
+
+  // Parameter list, nested lists become sub-list records
+  void list() {
+    skip();
+    expect('(');
+    data.RecordListStart();
+    skip();
+    if (pos < end && *pos == ')') {
+      ++pos;
+    } else {
+      while (true) {
+        parameter();
+        skip();
+        if (pos < end && *pos == ',') {
+          ++pos;
+          data.PrepareNewArg();
+          skip();
+          continue;
+        }
+        expect(')');
+        break;
+      }
+    }
+    data.RecordNewEntity();
+  }
+
+  void parameter() {
+    if (pos >= end) {
+      fail("parameter expected");
+    }
+    const char *start = pos;
+    char c = *pos;
+    if (c == '#') {
+      ++pos;
+      while (pos < end && is_digit(*pos)) {
+        ++pos;
+      }
+      if (pos - start < 2) {
+        fail("entity reference expected");
+      }
+      text(start, Interface_ParamIdent);
+    } else if (c == '\'') {
+      // '' is a quote, the text is kept quoted like the stock lexer does
+      ++pos;
+      while (true) {
+        while (pos < end && *pos != '\'' && *pos != '\n' && *pos != '\r') {
+          ++pos;
+        }
+        if (pos >= end || *pos != '\'') {
+          fail("string spanning lines");
+        }
+        ++pos;
+        if (pos < end && *pos == '\'') {
+          ++pos;
+          continue;
+        }
+        break;
+      }
+      text(start, Interface_ParamText);
+    } else if (c == '"') {
+      ++pos;
+      while (pos < end && (is_digit(*pos) || (*pos >= 'A' && *pos <= 'F'))) {
+        ++pos;
+      }
+      expect('"');
+      text(start, Interface_ParamHexa);
+    } else if (c == '.' && pos + 1 < end && (is_upper(pos[1]) || pos[1] == '_')) {
+      ++pos;
+      while (pos < end && (is_upper(*pos) || is_digit(*pos) || *pos == '_')) {
+        ++pos;
+      }
+      expect('.');
+      text(start, Interface_ParamEnum);
+    } else if (c == '$') {
+      ++pos;
+      text(start, Interface_ParamVoid);
+    } else if (c == '*') {
+      ++pos;
+      text(start, Interface_ParamMisc);
+    } else if (c == '(') {
+      list();
+    } else if (is_digit(c) || c == '-' || c == '+' || c == '.') {
+      number();
+    } else if (is_keyword_char(c) || c == '!') {
+      // Typed parameter, TYPE(value)
+      type();
+      data.RecordTypeText();
+      list();
+    } else {
+      fail(std::string("unexpected '") + c + "'");
+    }
+    data.CreateNewArg();
+  }
+
+  void number() {
+    const char *start = pos;
+    if (*pos == '-' || *pos == '+') {
+      ++pos;
+    }
+    bool real = false, digits = false;
+    while (pos < end) {
+      if (is_digit(*pos)) {
+        digits = true;
+      } else if (*pos == '.') {
+        real = true;
+      } else if (*pos == 'E' || *pos == 'e') {
+        real = true;
+        if (pos + 1 < end && (pos[1] == '-' || pos[1] == '+')) {
+          ++pos;
+        }
+      } else {
+        break;
+      }
+      ++pos;
+    }
+    if (!digits) {
+      fail("number expected");
+    }
+    text(start, real ? Interface_ParamReal : Interface_ParamInteger);
+  }
+
+  const char *file;
+  const char *pos, *end;
+  Data &data;
+};
+
+// Counts the entities of a chunk from the calls ChunkParser makes, without
+// recording their parameters. Type names point into the mapped file
+class EntityCounter
+{
+public:
+  void CreateNewText(const char *text, int length) { last = std::string_view(text, length); }
+  void SetTypeArg(Interface_ParamType type) {
+    if (type != Interface_ParamIdent || !id) {
+      return;
+    }
+    // B_SPLINE_SURFACE(u_degree, v_degree, ((#pole, ...), ...), ...)
+    if (depth == 3 && (partial == "B_SPLINE_SURFACE" || partial == "B_SPLINE_SURFACE_WITH_KNOTS"
+                       || partial == "BEZIER_SURFACE" || partial == "UNIFORM_SURFACE"
+                       || partial == "QUASI_UNIFORM_SURFACE")) {
+      ++poles;
+    }
+    // ADVANCED_FACE(name, (bounds), #surface, same_sense)
+    if (depth == 1 && (partial == "ADVANCED_FACE" || partial == "FACE_SURFACE")) {
+      face_surface = reference(last);
+    }
+  }
+  void RecordIdent() {
+    finish();
+    id = reference(last);
+  }
+  void RecordType() {
+    partial = last;
+    type += type.empty() ? "" : " ";
+    type += last;
+    std::string_view suffix = "_SURFACE";
+    surface = surface || partial == "PLANE"
+      || (partial.size() > suffix.size() && partial.substr(partial.size() - suffix.size()) == suffix)
+      || partial.substr(0, 16) == "B_SPLINE_SURFACE" || partial.substr(0, 11) == "SURFACE_OF_";
+  }
+  void RecordListStart() { ++depth; }
+  void RecordNewEntity() { --depth; }
+  void FinalOfHead() {
+    type.clear();
+    surface = false;
+  }
+  void RecordTypeText() {}
+  void PrepareNewArg() {}
+  void CreateNewArg() {}
+
+  // Counts the last entity of the chunk
+  void finish() {
+    if (!type.empty()) {
+      auto counted = types.try_emplace(type, 0).first;
+      ++counted->second;
+      if (face_surface) {
+        face_surfaces.push_back(face_surface);
+      }
+      if (surface) {
+        surfaces[id] = &counted->first;
+      }
+    }
+    type.clear();
+    surface = false;
+    face_surface = 0;
+  }
+
+  std::unordered_map<std::string, uint64_t> types;
+  std::unordered_map<uint64_t, const std::string*> surfaces;   // type of every surface entity
+  std::vector<uint64_t> face_surfaces;                         // surface of every face
+  uint64_t poles = 0;
+
+private:
+  static uint64_t reference(std::string_view ident) {
+    uint64_t value = 0;
+    std::from_chars(ident.data() + 1, ident.data() + ident.size(), value);
+    return value;
+  }
+
+  std::string_view last, partial;
+  std::string type;
+  uint64_t id = 0, face_surface = 0;
+  bool surface = false;
+  int depth = 0;
+};
+
+// Start of the ENDSEC closing the DATA section, the file must end with
+// "ENDSEC; END-ISO-10303-21;"
+const char *data_end(const MappedFile &file) {
+  auto back = [&](const char *pos, const char *word) -> const char* {
+    while (pos > file.begin() && is_space(pos[-1])) {
+      --pos;
+    }
+    size_t length = std::strlen(word);
+    if (static_cast<size_t>(pos - file.begin()) < length || std::memcmp(pos - length, word, length) != 0) {
+      throw Unsupported(std::string("file does not end with ") + word);
+    }
+    return pos - length;
+  };
+  const char *pos = back(file.end(), ";");
+  pos = back(pos, "END-ISO-10303-21");
+  pos = back(pos, ";");
+  return back(pos, "ENDSEC");
+}
+
+// First position after target that follows a ';' and precedes a line
+// break and "#<id> ="
+const char *next_boundary(const char *target, const char *end) {
+  const char *pos = target;
+  while (pos < end) {
+    auto semicolon = static_cast<const char*>(std::memchr(pos, ';', end - pos));
+    if (!semicolon) {
+      return end;
+    }
+    pos = semicolon + 1;
+    const char *next = pos;
+    bool line_break = false;
+    while (next < end && is_space(*next)) {
+      line_break = line_break || *next == '\n';
+      ++next;
+    }
+    if (!line_break || next >= end || *next != '#') {
+      continue;
+    }
+    const char *digits = ++next;
+    while (next < end && is_digit(*next)) {
+      ++next;
+    }
+    while (next < end && is_space(*next)) {
+      ++next;
+    }
+    if (next > digits && next < end && *next == '=') {
+      return pos;
+    }
+  }
+  return end;
+}
+
+std::vector<const char*> chunk_boundaries(const char *begin, const char *end, int threads) {
+  size_t size = end - begin;
+  size_t count = std::max<size_t>(1, std::min(threads * chunks_per_thread, size / min_chunk_size));
+  std::vector<const char*> boundaries = {begin};
+  for (size_t i = 1; i < count; ++i) {
+    const char *boundary = next_boundary(std::max(begin + size * i / count, boundaries.back()), end);
+    if (boundary > boundaries.back() && boundary < end) {
+      boundaries.push_back(boundary);
+    }
+  }
+  boundaries.push_back(end);
+  return boundaries;
+}
+
+// Runs parse(i) for every chunk on threads, rethrows the error of the
+// first failed chunk
+template<typename Parse>
+void parse_chunks(size_t count, int threads, const Parse &parse) {
+  std::vector<std::exception_ptr> errors(count);
+  std::atomic<size_t> next{0};
+  auto work = [&]() {
+    for (size_t i = next++; i < count; i = next++) {
+      try {
+        OCC_CATCH_SIGNALS
+        parse(i);
+      } catch(...) {
+        errors[i] = std::current_exception();
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (int i = 1; i < std::min<int>(threads, count); ++i) {
+    workers.emplace_back(work);
+  }
+  work();
+  for (auto &worker: workers) {
+    worker.join();
+  }
+  for (auto &error: errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+}
+
+// Sub-lists are records with a "$<n>" ident, referenced by Interface_ParamSub
+// parameters of the same name. Every StepFile_ReadData numbers them from 1,
+// so the names of a chunk are shifted by the sub-lists of the chunks before
+// it, giving the merged records the unique numbering of a single parse.
+// Returns name, or the shifted name in buffer; last gets the largest number
+// seen in the chunk
+const char *shifted_sublist(const char *name, int offset, int &last, std::string &buffer) {
+  int number = 0;
+  const char *end = name + std::strlen(name);
+  if (name[0] != '$' || std::from_chars(name + 1, end, number).ptr != end || number <= 0) {
+    throw Unsupported(std::string("unexpected sub-list name ") + name);
+  }
+  last = std::max(last, number);
+  if (offset == 0) {
+    return name;
+  }
+  buffer = "$" + std::to_string(number + offset);
+  return buffer.c_str();
+}
+
+void read_model(
+    const std::filesystem::path &path, int threads,
+    const Handle(StepData_StepModel) &model,
+    const Handle(StepData_Protocol) &protocol) {
+  threads = std::max(threads, 1);
+  MappedFile file(path);
+  const char *end = data_end(file);
+
+  // The header is recorded first, in the chunk starting the DATA section
+  std::vector<std::unique_ptr<StepFile_ReadData>> chunks;
+  chunks.push_back(std::make_unique<StepFile_ReadData>());
+  const char *begin = ChunkParser(file.begin(), file.begin(), end, *chunks.front()).header();
+
+  auto boundaries = chunk_boundaries(begin, end, threads);
+  for (size_t i = 1; i + 1 < boundaries.size(); ++i) {
+    chunks.push_back(std::make_unique<StepFile_ReadData>());
+    chunks.back()->FinalOfHead();
+  }
+  parse_chunks(chunks.size(), threads, [&](size_t i) {
+    ChunkParser(file.begin(), boundaries[i], boundaries[i+1], *chunks[i]).entities();
+  });
+
+  int nb_head = 0, nb_records = 0, nb_params = 0;
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    int head, records, params;
+    chunks[i]->GetFileNbR(&head, &records, &params);
+    nb_head += i == 0 ? head : 0;
+    nb_records += records;
+    nb_params += params;
+  }
+
+  // Same copy as the stock reader, chunk after chunk
+  Handle(StepData_StepReaderData) records =
+    new StepData_StepReaderData(nb_head, nb_records, nb_params, model->SourceCodePage());
+  int num = 0, sublists = 0;
+  std::string buffer;
+  for (auto &chunk: chunks) {
+    int head, count, params, last = 0;
+    chunk->GetFileNbR(&head, &count, &params);
+    for (int i = 0; i < count; ++i) {
+      char *ident, *type;
+      int nb_args;
+      chunk->GetRecordDescription(&ident, &type, &nb_args);
+      const char *name = ident[0] == '$' ? shifted_sublist(ident, sublists, last, buffer) : ident;
+      records->SetRecord(++num, name, type, nb_args);
+      if (nb_args > 0) {
+        Interface_ParamType param_type;
+        char *value;
+        while (chunk->GetArgDescription(&param_type, &value)) {
+          const char *arg = param_type == Interface_ParamSub
+            ? shifted_sublist(value, sublists, last, buffer) : value;
+          records->AddStepParam(num, arg, param_type);
+        }
+      }
+      records->InitParams(num);
+      chunk->NextRecord();
+    }
+    sublists += last;
+    chunk.reset();
+  }
+
+  StepData_StepReaderTool tool(records, protocol);
+  tool.SetErrorHandle(true);
+  tool.PrepareHeader(Handle(StepData_FileRecognizer)());
+  tool.Prepare(Handle(StepData_FileRecognizer)());
+  tool.LoadModel(model);
+  if (model->Protocol().IsNull()) {
+    model->SetProtocol(protocol);
+  }
+}
+
+StepScan scan_model(const std::filesystem::path &path, int threads) {
+  threads = std::max(threads, 1);
+  MappedFile file(path);
+  const char *end = data_end(file);
+
+  EntityCounter header;
+  const char *begin = ChunkParser(file.begin(), file.begin(), end, header).header();
+  auto boundaries = chunk_boundaries(begin, end, threads);
+  std::vector<EntityCounter> chunks(boundaries.size() - 1);
+  parse_chunks(chunks.size(), threads, [&](size_t i) {
+    ChunkParser(file.begin(), boundaries[i], boundaries[i+1], chunks[i]).entities();
+    chunks[i].finish();
+  });
+
+  // Faces may refer to surfaces of other chunks
+  StepScan scan;
+  std::unordered_map<uint64_t, const std::string*> surfaces;
+  for (auto &chunk: chunks) {
+    for (auto &[type, count]: chunk.types) {
+      scan.types[type] += count;
+      scan.entities += count;
+    }
+    surfaces.insert(chunk.surfaces.begin(), chunk.surfaces.end());
+    scan.poles += chunk.poles;
+  }
+  for (auto &chunk: chunks) {
+    for (auto surface: chunk.face_surfaces) {
+      auto found = surfaces.find(surface);
+      ++scan.face_surfaces[found != surfaces.end() ? *found->second : std::string()];
+    }
+  }
+  return scan;
+}
+
+} // namespace
+
+bool read_step_parallel(
+    STEPControl_Reader &reader,
+    const std::filesystem::path &path,
+    int threads,
+    std::string &reason) {
+  Handle(StepData_Protocol) protocol = Handle(StepData_Protocol)::DownCast(reader.WS()->Protocol());
+  if (protocol.IsNull()) {
+    reason = "no STEP protocol in the session";
+    return false;
+  }
+  Handle(StepData_StepModel) model = new StepData_StepModel;
+  model->InternalParameters.InitFromStatic();
+  model->SetSourceCodePage(model->InternalParameters.ReadCodePage);
+  try {
+    OCC_CATCH_SIGNALS
+    read_model(path, threads, model, protocol);
+  } catch(Unsupported &err) {
+    reason = err.what();
+    return false;
+  } catch(Standard_Failure &err) {
+    reason = err.GetMessageString();
+    return false;
+  } catch(std::exception &err) {
+    reason = err.what();
+    return false;
+  }
+  // What XSControl_Reader::ReadFile does with a freshly read model
+  reader.WS()->SetModel(model);
+  reader.WS()->SetLoadedFile(path.c_str());
+  reader.WS()->InitTransferReader(4);
+  return true;
+}
+
+IFSelect_ReturnStatus read_step(
+    STEPControl_Reader &reader,
+    const std::filesystem::path &path,
+    const PipelineOptions &options) {
+  if (options.parallel_read) {
+    std::string reason;
+    if (read_step_parallel(reader, path, options.jobs, reason)) {
+      return IFSelect_RetDone;
+    }
+    reporter().message("Parallel STEP reader: " + reason + ", using the stock reader");
+  }
+  return reader.ReadFile(path.c_str());
+}
+
+StepScan scan_step(const std::filesystem::path &path, int threads) {
+  try {
+    OCC_CATCH_SIGNALS
+    return scan_model(path, threads);
+  } catch(Unsupported &err) {
+    throw std::runtime_error("can't scan " + path.string() + ": " + err.what());
+  }
+}
@@ -0,0 +1,473 @@
+#include <iostream>
+#include <chrono>
+#include <map>
+#include <set>
+#include <csignal>
+#include <cstring>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+#include "common.hpp"
+#include "byte_buffer.hpp"
+
+// Supervisor mode (--isolate): solids are processed by forked worker
+// processes, so a solid that crashes, hangs or eats all the memory only
+// takes down its worker. Workers inherit the loaded model on fork, the
+// supervisor only sends them solid ids and receives the results back
+// (converted shapes serialized with BinTools). Instances of a part are
+// converted once per worker process rather than once per run. Their
+// version 300 records still point at the prototype, which another worker
+// may have failed on: such instances are failed as well when emitted.
+
+namespace {
+
+using namespace byte_buffer;
+using Clock = std::chrono::steady_clock;
+
+struct Worker
+{
+  pid_t pid = -1;
+  int task_fd = -1;
+  int result_fd = -1;
+  int solid_id = -1;
+  Clock::time_point started;
+  size_t spawn_memory = 0;    // RSS right after fork, the pages shared with the supervisor
+};
+
+// Memory the worker allocated itself. Its RSS also counts the whole model
+// it shares with the supervisor since the fork
+size_t worker_memory(const Worker &worker) {
+  if (size_t own = private_memory(worker.pid)) {
+    return own;
+  }
+  size_t resident = resident_memory(worker.pid);
+  return resident > worker.spawn_memory ? resident - worker.spawn_memory : 0;
+}
+
+bool write_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+bool read_all(int fd, char *data, size_t size) {
+  while (size > 0) {
+    ssize_t got = read(fd, data, size);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      return false;
+    }
+    data += got;
+    size -= got;
+  }
+  return true;
+}
+
+// Optional shapes are sent as: 0 - not requested, 1 - requested but empty
+// (conversion failed), 2 - followed by the BinTools dump of the shape.
+void put_shape(std::string &buf, const std::optional<TopoDS_Shape> &shape) {
+  if (!shape) {
+    put<uint8_t>(buf, 0);
+  } else if (shape.value().IsNull()) {
+    put<uint8_t>(buf, 1);
+  } else {
+    put<uint8_t>(buf, 2);
+    std::ostringstream out(std::ios::binary);
+    BinTools::Write(shape.value(), out, false, false, BinTools_FormatVersion_CURRENT);
+    put_string(buf, out.str());
+  }
+}
+
+std::optional<TopoDS_Shape> get_shape(Cursor &cursor) {
+  auto tag = cursor.get<uint8_t>();
+  if (tag == 0) {
+    return std::nullopt;
+  }
+  TopoDS_Shape shape;
+  if (tag == 2) {
+    std::istringstream in(cursor.get_string(), std::ios::binary);
+    BinTools::Read(shape, in);
+  }
+  return shape;
+}
+
+std::string encode_output(int solid_id, const SolidOutput &output) {
+  std::string buf;
+  put<int32_t>(buf, solid_id);
+  put<uint8_t>(buf, output.nurbs.has_value());
+  if (output.nurbs) {
+    put_string(buf, output.nurbs.value());
+  }
+  put_shape(buf, output.conv_shape);
+  put_shape(buf, output.conv_shape_notrim);
+  put<uint8_t>(buf, output.stats.has_value());
+  if (output.stats) {
+    auto &stats = output.stats.value();
+    put(buf, static_cast<uint64_t>(stats.fails.size()));
+    for (auto &fail: stats.fails) {
+      put_string(buf, fail);
+    }
+    // Failed solids are the original ones, the supervisor already has them
+    put(buf, static_cast<uint64_t>(stats.failed_solids.size()));
+    for (auto &[name, solid]: stats.failed_solids) {
+      put_string(buf, name);
+    }
+  }
+  put<uint8_t>(buf, output.meshes.has_value());
+  if (output.meshes) {
+    put(buf, static_cast<uint64_t>(output.meshes.value().size()));
+    for (auto &mesh: output.meshes.value()) {
+      put_string(buf, mesh);
+    }
+  }
+  put<uint8_t>(buf, output.metrics.has_value());
+  if (output.metrics) {
+    auto &metrics = output.metrics.value();
+    put(buf, metrics.mesh);
+    put(buf, metrics.convert);
+    put(buf, metrics.output);
+    put(buf, metrics.bytes);
+    put(buf, metrics.face_types);
+    put(buf, metrics.poles);
+    put(buf, metrics.knots);
+    put(buf, metrics.bspline_poles);
+    put(buf, metrics.failed_faces);
+    put<uint8_t>(buf, metrics.reused);
+    put_string(buf, metrics.failure);
+  }
+  put_string(buf, output.failure);
+  put<uint8_t>(buf, output.cache_hit ? 1 + output.cache_hit.value() : 0);
+  return buf;
+}
+
+SolidOutput decode_output(const std::string &buf, const ModelIndex &index) {
+  Cursor cursor{buf};
+  SolidOutput output;
+  int solid_id = cursor.get<int32_t>();
+  if (cursor.get<uint8_t>()) {
+    output.nurbs = cursor.get_string();
+  }
+  output.conv_shape = get_shape(cursor);
+  output.conv_shape_notrim = get_shape(cursor);
+  if (cursor.get<uint8_t>()) {
+    output.stats = Statistics{};
+    auto &stats = output.stats.value();
+    auto fails = cursor.get<uint64_t>();
+    for (uint64_t i = 0; i < fails; ++i) {
+      stats.fails.push_back(cursor.get_string());
+    }
+    auto failed_solids = cursor.get<uint64_t>();
+    for (uint64_t i = 0; i < failed_solids; ++i) {
+      stats.failed_solids.push_back({cursor.get_string(), index.solid(solid_id)});
+    }
+  }
+  if (cursor.get<uint8_t>()) {
+    output.meshes.emplace(cursor.get<uint64_t>());
+    for (auto &mesh: output.meshes.value()) {
+      mesh = cursor.get_string();
+    }
+  }
+  if (cursor.get<uint8_t>()) {
+    output.metrics = SolidMetrics{};
+    auto &metrics = output.metrics.value();
+    metrics.mesh = cursor.get<StageTime>();
+    metrics.convert = cursor.get<StageTime>();
+    metrics.output = cursor.get<StageTime>();
+    metrics.bytes = cursor.get<uint64_t>();
+    metrics.face_types = cursor.get<decltype(metrics.face_types)>();
+    metrics.poles = cursor.get<uint64_t>();
+    metrics.knots = cursor.get<uint64_t>();
+    metrics.bspline_poles = cursor.get<uint64_t>();
+    metrics.failed_faces = cursor.get<uint32_t>();
+    metrics.reused = cursor.get<uint8_t>();
+    metrics.failure = cursor.get_string();
+  }
+  output.failure = cursor.get_string();
+  if (auto cache_hit = cursor.get<uint8_t>()) {
+    output.cache_hit = cache_hit == 2;
+  }
+  return output;
+}
+
+// Output for a solid whose worker had to be killed or died
+SolidOutput failed_output(
+    int solid_id, const std::string &reason,
+    const TopoDS_Solid &solid,
+    const PipelineOptions &options) {
+  reporter().error(solid_id, reason);
+  SolidOutput output;
+  if (options.nurbs) {
+    output.nurbs = std::string();
+  }
+  if (options.conv_shape) {
+    output.conv_shape = TopoDS_Shape();
+  }
+  if (options.conv_shape_notrim) {
+    output.conv_shape_notrim = TopoDS_Shape();
+  }
+  if (options.log_fails) {
+    output.stats = Statistics{};
+    output.stats.value().fails.push_back(std::to_string(solid_id)+": "+reason);
+    output.stats.value().failed_solids.push_back({std::to_string(solid_id)+".brep", solid});
+  }
+  if (options.stl && options.mesh_container) {
+    output.meshes.emplace(options.lod_levels);
+  }
+  if (options.metrics) {
+    output.metrics = SolidMetrics{};
+    output.metrics.value().failure = reason;
+  }
+  output.failure = reason;
+  return output;
+}
+
+// An instance record would point at a prototype without data: the
+// instance has no surfaces of its own in the .nurbs output, it is failed
+void fail_instance(int solid_id, int prototype, const TopoDS_Solid &solid, SolidOutput &output) {
+  std::string reason = "prototype " + std::to_string(prototype) + " failed";
+  reporter().error(solid_id, reason);
+  output.nurbs = std::string();
+  output.failure = reason;
+  if (output.stats) {
+    output.stats.value().fails.push_back(std::to_string(solid_id)+": "+reason);
+    if (output.stats.value().failed_solids.empty()) {
+      output.stats.value().failed_solids.push_back({std::to_string(solid_id)+".brep", solid});
+    }
+  }
+  if (output.metrics) {
+    output.metrics.value().failure = reason;
+  }
+}
+
+[[noreturn]] void worker_main(
+    int task_fd, int result_fd,
+    const ModelIndex &index,
+    const PipelineOptions &options) {
+  // The reporter thread of the supervisor does not exist in the worker
+  reporter().detach();
+  // Instances are only shared within one worker process
+  InstanceCache cache(index);
+  int32_t solid_id;
+  while (read_all(task_fd, reinterpret_cast<char*>(&solid_id), sizeof(solid_id))
+         && solid_id >= 0) {
+    std::string message;
+    auto &solid = index.solid(solid_id);
+    try {
+      SolidOutput output;
+      process_solid(solid_id, index, cache, options, output);
+      message = encode_output(solid_id, output);
+    } catch(Standard_Failure &err) {
+      message = encode_output(solid_id, failed_output(solid_id, err.GetMessageString(), solid, options));
+    } catch(std::exception &err) {
+      message = encode_output(solid_id, failed_output(solid_id, err.what(), solid, options));
+    } catch(...) {
+      message = encode_output(solid_id, failed_output(solid_id, "Unknown", solid, options));
+    }
+    uint64_t size = message.size();
+    if (!write_all(result_fd, reinterpret_cast<const char*>(&size), sizeof(size))
+        || !write_all(result_fd, message.data(), message.size())) {
+      break;
+    }
+  }
+  std::cout << std::flush;
+  _exit(0);
+}
+
+Worker spawn_worker(
+    const ModelIndex &index,
+    const PipelineOptions &options,
+    const std::vector<Worker> &others) {
+  int task_pipe[2], result_pipe[2];
+  if (pipe(task_pipe) != 0) {
+    throw std::runtime_error(std::string("pipe() failed: ") + std::strerror(errno));
+  }
+  if (pipe(result_pipe) != 0) {
+    int error = errno;
+    close(task_pipe[0]);
+    close(task_pipe[1]);
+    throw std::runtime_error(std::string("pipe() failed: ") + std::strerror(error));
+  }
+  std::cout << std::flush;
+  std::cerr << std::flush;
+  pid_t pid = fork();
+  if (pid < 0) {
+    int error = errno;
+    for (int fd: {task_pipe[0], task_pipe[1], result_pipe[0], result_pipe[1]}) {
+      close(fd);
+    }
+    throw std::runtime_error(std::string("fork() failed: ") + std::strerror(error));
+  }
+  if (pid == 0) {
+    close(task_pipe[1]);
+    close(result_pipe[0]);
+    for (auto &other: others) {
+      if (other.pid > 0) {
+        close(other.task_fd);
+        close(other.result_fd);
+      }
+    }
+    worker_main(task_pipe[0], result_pipe[1], index, options);
+  }
+  close(task_pipe[0]);
+  close(result_pipe[1]);
+  Worker worker;
+  worker.pid = pid;
+  worker.task_fd = task_pipe[1];
+  worker.result_fd = result_pipe[0];
+  worker.spawn_memory = resident_memory(pid);
+  return worker;
+}
+
+void stop_worker(Worker &worker, bool force) {
+  if (force) {
+    kill(worker.pid, SIGKILL);
+  } else {
+    int32_t stop = -1;
+    write_all(worker.task_fd, reinterpret_cast<const char*>(&stop), sizeof(stop));
+  }
+  close(worker.task_fd);
+  close(worker.result_fd);
+  waitpid(worker.pid, nullptr, 0);
+  worker = Worker{};
+}
+
+} // namespace
+
+void process_solids_isolated(
+    const ModelIndex &index,
+    const PipelineOptions &options,
+    const std::function<void(int, SolidOutput&)> &emit) {
+  // A worker that died must not kill the supervisor on the next write
+  std::signal(SIGPIPE, SIG_IGN);
+
+  int first_id = index.first_id, shapes_total = index.end_id();
+  int jobs = std::min(std::max(options.jobs, 1), std::max(index.size(), 1));
+  const int window = 16 * jobs;
+  std::vector<Worker> workers(jobs);
+  std::map<int, SolidOutput> finished;
+  int next_solid = first_id, next_emit = first_id;
+  // Emitted without .nurbs data, prototypes come before their instances
+  std::set<int> failed;
+
+  auto finish = [&](Worker &worker, SolidOutput output) {
+    finished.emplace(worker.solid_id, std::move(output));
+    worker.solid_id = -1;
+  };
+
+  auto kill_and_fail = [&](Worker &worker, const std::string &reason) {
+    int solid_id = worker.solid_id;
+    stop_worker(worker, true);
+    worker.solid_id = solid_id;
+    finish(worker, failed_output(solid_id, reason, index.solid(solid_id), options));
+  };
+
+  try {
+    while (next_emit < shapes_total) {
+      // Hand out solids to idle (or respawned) workers
+      for (auto &worker: workers) {
+        if (worker.solid_id >= 0 || next_solid >= shapes_total || next_solid >= next_emit + window) {
+          continue;
+        }
+        if (worker.pid <= 0) {
+          worker = spawn_worker(index, options, workers);
+        }
+        int32_t solid_id = next_solid;
+        if (!write_all(worker.task_fd, reinterpret_cast<const char*>(&solid_id), sizeof(solid_id))) {
+          stop_worker(worker, true);
+          continue;
+        }
+        worker.solid_id = next_solid++;
+        worker.started = Clock::now();
+      }
+
+      std::vector<pollfd> fds;
+      std::vector<Worker*> polled;
+      for (auto &worker: workers) {
+        if (worker.solid_id >= 0) {
+          fds.push_back({worker.result_fd, POLLIN, 0});
+          polled.push_back(&worker);
+        }
+      }
+      if (!fds.empty()) {
+        int ready = poll(fds.data(), fds.size(), 100);
+        if (ready < 0 && errno != EINTR) {
+          throw std::runtime_error(std::string("poll() failed: ") + std::strerror(errno));
+        }
+      }
+
+      for (size_t i = 0; i < fds.size(); ++i) {
+        Worker &worker = *polled[i];
+        if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+          uint64_t size = 0;
+          std::string message;
+          bool received = read_all(worker.result_fd, reinterpret_cast<char*>(&size), sizeof(size));
+          if (received) {
+            message.resize(size);
+            received = read_all(worker.result_fd, message.data(), size);
+          }
+          if (received) {
+            finish(worker, decode_output(message, index));
+            continue;
+          }
+          int status = 0;
+          waitpid(worker.pid, &status, 0);
+          close(worker.task_fd);
+          close(worker.result_fd);
+          std::string reason = WIFSIGNALED(status)
+            ? "Worker killed by signal " + std::to_string(WTERMSIG(status))
+            : "Worker exited with code " + std::to_string(WEXITSTATUS(status));
+          int solid_id = worker.solid_id;
+          worker = Worker{};
+          worker.solid_id = solid_id;
+          finish(worker, failed_output(solid_id, reason, index.solid(solid_id), options));
+          continue;
+        }
+        auto elapsed = std::chrono::duration<double>(Clock::now() - worker.started).count();
+        if (options.solid_timeout > 0 && elapsed > options.solid_timeout) {
+          kill_and_fail(worker, "Timeout (" + std::to_string(options.solid_timeout) + " s)");
+        } else if (options.solid_memory > 0 && worker_memory(worker) > options.solid_memory) {
+          kill_and_fail(worker, "Out of memory budget (" + std::to_string(options.solid_memory >> 20) + " MB)");
+        }
+      }
+
+      for (auto it = finished.begin(); it != finished.end() && it->first == next_emit; it = finished.erase(it)) {
+        auto &output = it->second;
+        int prototype = output.nurbs ? nurbs_instance_prototype(output.nurbs.value()) : -1;
+        if (prototype >= 0 && failed.count(prototype)) {
+          fail_instance(next_emit, prototype, index.solid(next_emit), output);
+        }
+        if (!output.failure.empty()) {
+          failed.insert(next_emit);
+        }
+        emit(next_emit, output);
+        ++next_emit;
+      }
+    }
+  } catch(...) {
+    for (auto &worker: workers) {
+      if (worker.pid > 0) {
+        stop_worker(worker, true);
+      }
+    }
+    throw;
+  }
+
+  for (auto &worker: workers) {
+    if (worker.pid > 0) {
+      stop_worker(worker, false);
+    }
+  }
+}
@@ -1,14 +1,48 @@
+#include <cmath>
 #include <filesystem>
-#include "occt_headers.hpp"
+#include <vector>
+#include "common.hpp"
 
 void export_to_stl(const TopoDS_Shape& shape, std::filesystem::path path) {
   StlAPI_Writer writer;
+  writer.ASCIIMode() = false;
   writer.Write(shape, path.c_str());
 }
 
-void tesselate_solid(const TopoDS_Solid& shape, std::filesystem::path save_path) {
-    // Тесселяция с Deflection = 0.1
-    double deflection = 0.1;
-    BRepMesh_IncrementalMesh tesselator(shape, deflection, true, 0.5f, true);
+// Absolute chord tolerance for the solid: a fraction of its bounding box
+// diagonal, so small and large parts get a comparable number of triangles
+double solid_deflection(const TopoDS_Shape& shape, double relative_deflection) {
+  Bnd_Box box;
+  BRepBndLib::Add(shape, box, false);
+  if (box.IsVoid()) {
+    return relative_deflection;
+  }
+  return std::max(relative_deflection * std::sqrt(box.SquareExtent()), Precision::Confusion());
+}
+
+void mesh_solid(const TopoDS_Shape& shape, double deflection) {
+    BRepMesh_IncrementalMesh tesselator(shape, deflection, false, 0.5f, true);
+}
+
+// Meshes the shape from the coarsest level to the finest one (deflection).
+// BRepMesh_IncrementalMesh does not refine a coarser triangulation, it
+// meshes again from scratch every face out of the new tolerance, so each
+// level costs a full meshing, and a BRepBuilderAPI_Copy for the coarser
+// ones. Returns the levels from the finest to the coarsest; the finest one
+// is the shape itself, coarser ones are copies keeping their own
+// triangulation.
+std::vector<TopoDS_Shape> mesh_solid_lods(const TopoDS_Shape& shape, double deflection, int levels) {
+  std::vector<TopoDS_Shape> lods(levels);
+  for (int level = levels-1; level > 0; --level) {
+    mesh_solid(shape, deflection * std::pow(lod_ratio, level));
+    lods[level] = BRepBuilderAPI_Copy(shape, false, true).Shape();
+  }
+  mesh_solid(shape, deflection);
+  lods[0] = shape;
+  return lods;
+}
+
+void tesselate_solid(const TopoDS_Solid& shape, double deflection, std::filesystem::path save_path) {
+    mesh_solid(shape, deflection);
     export_to_stl(shape, save_path);
-}
\ No newline at end of file
+}